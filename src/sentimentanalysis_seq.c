@@ -2,208 +2,6439 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <time.h> // Include for srand and time
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+#include <sys/mman.h> // mmap for saved indexes
+#include <sys/stat.h>
+#include <sys/resource.h> // getrusage for peak memory
+#include <sys/wait.h>
+#include <time.h> // Include for time and clock_gettime
+#include <pthread.h> // Read-ahead thread of the spilled training epochs
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h> // SIMD kernels, selected at run time
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h> // Hardware cache miss counters
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define MAX_TOKENS 1024
-#define NUM_FEATURES 1024
+#define NUM_FEATURES 1024 // Default number of per-character features, see feature_size
 
+// Dense dot products are summed in DENSE_LANES interleaved partial sums (vectorizable
+// without reassociation); every dense kernel instance uses this same order
+#define DENSE_LANES 8
+
+// Philox4x32-10 constants (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3")
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// Independent random streams derived from the run seed
+#define STREAM_WEIGHTS 1u
+#define STREAM_SHUFFLE 2u
+#define STREAM_BENCH 3u
+#define STREAM_PROJECTION 4u
+#define STREAM_LEVELS 5u
+#define STREAM_PQ 6u
+#define STREAM_SPILL 7u
+
+// Fixed reduction shape: values are summed in leaves of REDUCE_LEAF, leaves are combined
+// pairwise, and parallel reductions split work at multiples of REDUCE_CHUNK. The shape only
+// depends on the input length, so results are bit-identical for any thread count.
+#define REDUCE_LEAF 32
+#define REDUCE_CHUNK 4096
+
+// Score above which evaluate predicts a positive (4) label
+#define DECISION_THRESHOLD 0.6f
+
+// Cheap first-stage model of the cascade: hashed word features in a table small enough for L1
+#define CASCADE_HASH_BITS 12
+#define CASCADE_EPOCHS 3
+#define CASCADE_LEARNING_RATE 0.1f
+#define CASCADE_DENSE_LEARNING_RATE 0.01f // Dense rows have feature_size inputs, not a few words
+#define REMAP_HOT_WEIGHTS 8192 // Weights that fit a 32 KB L1 data cache
+#define REMAP_REPEATS 50
+#define PREFETCH_TUNE_REPEATS 3
+#define GATHER_REPEATS 5
+#define DEFAULT_LLC_BYTES (32u << 20) // When the cache size cannot be queried
+#define CACHE_LINE 64
+#define STREAM_BENCH_REPEATS 3
+#define SCAN_CHUNK (1 << 20) // Bytes of the dataset file prescanned per task
+#define SPILL_CHUNK_ROWS 65536 // Tweets per spilled feature chunk
+#define METRIC_SHARDS 64        // Per-thread shards of each metric (threads beyond share them)
+#define HDR_SUB_BITS 6          // Linear sub-buckets per power of two: 2^6, so values are kept within 1.6%
+#define HDR_MAX_BITS 40         // Largest value, in nanoseconds (about 18 minutes); larger ones are clamped
+#define HDR_BUCKETS ((HDR_MAX_BITS - HDR_SUB_BITS + 1) << HDR_SUB_BITS)
+#define LATENCY_BLOCK 16384     // Tweets per interval snapshot of --latency
+#define SCALING_BLOCK 65536     // Tweets per block of the scaling benchmark, which bounds its memory
+#define SCALING_POOL 65536      // Synthetic tweets sampled from when the dataset cannot be read
+#define MAX_SCALING_POINTS 16
+#define ROOFLINE_REPEATS 5
+#define ROOFLINE_CHAINS 12          // Independent FMA chains: covers FMA latency x issue width
+#define ROOFLINE_ITERATIONS (1 << 24)
+// glibc's expf: scale and round (2), reduce (2), table scale (1), degree-3 polynomial with
+// three fused multiply-adds (6) and the final scale (1)
+#define EXPF_FLOPS 12
+#define SIGMOID_FLOPS (EXPF_FLOPS + 3) // Negate, add and divide around the expf
+#define NUM_SCALING_STAGES 4
+#define TOKENIZE_BATCH 256      // Rows per tokenization task (and latency sample)
+
+// Register tile of the ensemble GEMM: ENSEMBLE_TILE tweets x ENSEMBLE_TILE models, each
+// accumulated in ENSEMBLE_LANES independent partial sums
+#define ENSEMBLE_TILE 4
+#define ENSEMBLE_LANES 8
+
+// Dimension of the random-projection tweet embeddings used for similarity search
+#define EMBED_DIM 64
+
+// HNSW graph: links per node on upper levels / level 0, build beam width, level cap
+#define HNSW_M 16
+#define HNSW_M0 32
+#define HNSW_EF_CONSTRUCTION 100
+#define HNSW_MAX_LEVEL 16
+#define HNSW_MAGIC "HNSWIDX2"
+
+// Product quantization of the embeddings: PQ_M subvectors with 256 centroids (8-bit codes)
+#define PQ_M 8
+#define PQ_SUBDIM (EMBED_DIM / PQ_M)
+#define PQ_CENTROIDS 256
+#define PQ_BLOCK 64
+#define PQ_TRAIN_SAMPLES 65536
+#define PQ_KMEANS_ITERATIONS 10
+#define PQ_RERANK_FACTOR 4
+
+// SimHash index: 16-bit blocks of the 64-bit signature, one table per block
+#define SIMHASH_BLOCKS 4
+
+// Character CNN: byte embedding size, convolution widths and filters, longest tweet prefix used
+#define CNN_EMBED 16
+#define CNN_NUM_WIDTHS 3
+#define CNN_WIDTHS { 3, 4, 5 }
+#define CNN_MAX_WIDTH 5
+#define CNN_FILTERS 32
+#define CNN_MAX_LEN 160
+#define CNN_BATCH 128
+#define CNN_GRAD_SLICES 16
+#define CNN_LEARNING_RATE 0.5f
+#define FEATURE_STORE_MAGIC 0x31534653u // "FSS1"
+#define FEATURE_STORE_WAIT_SECONDS 600 // How long an attaching process waits for the publisher
+#define WINDOW_BATCH 4096       // Windows tokenized and scored per batch
+#define WINDOW_MIN_WEIGHT 1e-3f // Keeps the confidence weights of undecided windows above 0
+
+// Hashed word features of many tweets in CSR layout: the ids of tweet i are
+// ids[offsets[i]] .. ids[offsets[i + 1] - 1]
 typedef struct {
-    char text[MAX_TOKENS];
+    int num_samples;
+    long long *offsets;
+    uint32_t *ids;
+} HashedFeatures;
+
+// Logistic regression over hashed word features
+typedef struct {
+    int hash_bits;
+    float *weights;
+    float bias;
+} HashedLinearModel;
+
+// One feature's share of a tweet's score (weight x value) and the character it came from
+typedef struct {
+    float contribution;
+    int position;
+} Contribution;
+
+// A tweet index and the key it is ranked by in top-K selection
+typedef struct {
+    float key;
+    int index;
+} ScoredIndex;
+
+// What top-K selection ranks tweets by
+typedef enum {
+    TOPK_POSITIVE,  // Highest scores
+    TOPK_NEGATIVE,  // Lowest scores
+    TOPK_UNCERTAIN  // Scores closest to DECISION_THRESHOLD
+} TopKMode;
+
+// Scoring kernels specialized for one size, looked up at run time
+typedef void (*DenseKernel)(const float *inputs, const float *weights, float bias, float *outputs, int num_samples, int size);
+typedef void (*HashedKernel)(const HashedLinearModel *model, const HashedFeatures *features, float *outputs);
+
+typedef struct {
+    int size;
+    DenseKernel kernel;
+} DenseKernelEntry;
+
+typedef struct {
+    int hash_bits;
+    HashedKernel kernel;
+} HashedKernelEntry;
+
+// Hashed feature remap: table[hash & mask] is the feature's rank by training frequency
+typedef struct {
+    int hash_bits;
+    uint32_t *table;
+} FeatureRemap;
+
+// Last-level cache miss counter (reads or stores), one perf event per thread of the parallel loops
+typedef struct {
+    int num_fds;
+    int *fds;
+} LlcMissCounter;
+
+// When the large intermediate writers use non-temporal (streaming) stores
+typedef enum {
+    NT_AUTO,   // Buffers larger than the last-level cache
+    NT_ALWAYS,
+    NT_NEVER
+} NonTemporalMode;
+
+typedef enum {
+    INIT_XAVIER, // Uniform in [-sqrt(6 / (fan_in + fan_out)), +sqrt(6 / (fan_in + fan_out))]
+    INIT_HE      // Normal with mean 0 and stddev sqrt(2 / fan_in)
+} WeightInit;
+
+// CSV columns between the label and the tweet, parsed only on demand (see postField)
+typedef enum {
+    FIELD_ID,
+    FIELD_DATE,
+    FIELD_FLAG,
+    FIELD_USER,
+    NUM_LAZY_FIELDS
+} PostField;
+
+// Text as (pointer, length); not NUL-terminated
+typedef struct {
+    const char *data;
+    int length;
+} StringView;
+
+typedef struct {
+    StringView text;                  // Into dataset_arena (or a caller's buffer)
     int label;
+    long long record;                 // Offset of the CSV record in dataset_arena, -1 if not kept
+    uint32_t fields[NUM_LAZY_FIELDS]; // Offsets of the lazy columns within the record
 } Post;
 
-// Custom implementation of strlen
-int custom_strlen(const char *str) {
-    int length = 0;
-    while (str[length] != '\0') {
-        length++;
+// Fixed-size record of the line-by-line loader
+typedef struct {
+    char text[MAX_TOKENS];
+    int label;
+} LegacyPost;
+
+// One parsed CSV record: where its tweet text sits in the file buffer, its label and where
+// its other columns start
+typedef struct {
+    long long record_offset;
+    long long text_offset;
+    int text_length; // -1 when the record has no tweet
+    int label;
+    uint32_t fields[NUM_LAZY_FIELDS];
+} RecordSpan;
+
+// The dataset file as loaded (memory mapped), kept for the whole run: tweet texts are views
+// into it and lazy columns are read from it
+typedef struct {
+    char *data;
+    size_t size;
+    int mapped; // munmap rather than free
+} DatasetArena;
+
+// Number of per-character features per tweet (the row width of the token matrix and of the
+// dense layer), set at run time with --features
+int feature_size = NUM_FEATURES;
+
+// Set with --nt-stores
+NonTemporalMode non_temporal_mode = NT_AUTO;
+
+// Filled by loadAndSplitDataset, freed by freeDatasetArena
+DatasetArena dataset_arena = { NULL, 0, 0 };
+
+// Characters that belong to a word token; everything else separates tokens
+static inline int isTokenChar(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '\'' || c == '@' || c == '#' || c == '_';
+}
+
+// View of a NUL-terminated string
+StringView stringView(const char *text) {
+    StringView view = { text, (int)strlen(text) };
+    return view;
+}
+
+// Wall clock time in seconds (clock() adds up CPU time of all threads)
+double wallSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Number of threads the parallel loops will use
+int maxThreads(void) {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Set the number of threads for the following parallel loops
+void setThreads(int num_threads) {
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#else
+    (void)num_threads;
+#endif
+}
+
+// Energy counters of the RAPL domains (packages and their DRAM), read with --energy
+#define MAX_RAPL_DOMAINS 16
+typedef struct {
+    int fd;           // energy_uj, kept open and re-read with pread
+    long long range;  // The counter wraps around after this many microjoules
+    char name[32];
+} RaplDomain;
+
+typedef struct {
+    long long microjoules[MAX_RAPL_DOMAINS];
+} EnergySample;
+
+int energy_enabled = 0;
+RaplDomain rapl_domains[MAX_RAPL_DOMAINS];
+int rapl_domain_count = 0;
+
+static long long readSysfsNumber(int fd) {
+    char text[32];
+    ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+    if (length <= 0) {
+        return -1;
+    }
+    text[length] = '\0';
+    return strtoll(text, NULL, 10);
+}
+
+// Read the name of a powercap zone (e.g. "package-0", "dram", "psys") without the newline
+static void readZoneName(const char *zone, char *name, size_t size) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/name", zone);
+    int fd = open(path, O_RDONLY);
+    ssize_t length = fd >= 0 ? pread(fd, name, size - 1, 0) : -1;
+    name[length > 0 ? length : 0] = '\0';
+    name[strcspn(name, "\n")] = '\0';
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void addRaplDomain(const char *zone) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/energy_uj", zone);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || readSysfsNumber(fd) < 0 || rapl_domain_count == MAX_RAPL_DOMAINS) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    RaplDomain *domain = &rapl_domains[rapl_domain_count++];
+    domain->fd = fd;
+    snprintf(path, sizeof(path), "%s/max_energy_range_uj", zone);
+    int range_fd = open(path, O_RDONLY);
+    domain->range = range_fd >= 0 ? readSysfsNumber(range_fd) : -1;
+    if (range_fd >= 0) {
+        close(range_fd);
+    }
+    readZoneName(zone, domain->name, sizeof(domain->name));
+}
+
+// Open the powercap RAPL counters: each package zone (package-N, which includes its core
+// and uncore subzones) and each DRAM subzone, which the package does not include. Other
+// top-level zones are skipped: psys covers the whole platform, packages included, so
+// adding it would count the package energy twice.
+void energyInit(void) {
+    energy_enabled = 1;
+    for (int index = 0; index < MAX_RAPL_DOMAINS; index++) {
+        char zone[128], name[32];
+        snprintf(zone, sizeof(zone), "/sys/class/powercap/intel-rapl:%d", index);
+        if (access(zone, F_OK) != 0) {
+            break;
+        }
+        readZoneName(zone, name, sizeof(name));
+        if (strncmp(name, "package-", 8) != 0) {
+            continue;
+        }
+        addRaplDomain(zone);
+        for (int sub = 0; sub < MAX_RAPL_DOMAINS; sub++) {
+            char subzone[160];
+            snprintf(subzone, sizeof(subzone), "%s/intel-rapl:%d:%d", zone, index, sub);
+            if (access(subzone, F_OK) != 0) {
+                break;
+            }
+            readZoneName(subzone, name, sizeof(name));
+            if (strcmp(name, "dram") == 0) {
+                addRaplDomain(subzone);
+            }
+        }
+    }
+    if (rapl_domain_count == 0) {
+        printf("Energy Counters: unavailable (no readable /sys/class/powercap/intel-rapl:*/energy_uj)\n");
+        return;
+    }
+    printf("Energy Counters:");
+    for (int d = 0; d < rapl_domain_count; d++) {
+        printf(" %s", rapl_domains[d].name);
+    }
+    printf(" (whole packages: other processes are included)\n");
+}
+
+EnergySample energySample(void) {
+    EnergySample sample;
+    for (int d = 0; d < rapl_domain_count; d++) {
+        sample.microjoules[d] = readSysfsNumber(rapl_domains[d].fd);
+    }
+    return sample;
+}
+
+// Joules used by all domains since start, or -1 when the counters are unavailable
+double energyJoulesSince(const EnergySample *start) {
+    if (rapl_domain_count == 0) {
+        return -1.0;
+    }
+    EnergySample now = energySample();
+    long long total = 0;
+    for (int d = 0; d < rapl_domain_count; d++) {
+        if (now.microjoules[d] < 0 || start->microjoules[d] < 0) {
+            return -1.0;
+        }
+        long long delta = now.microjoules[d] - start->microjoules[d];
+        if (delta < 0 && rapl_domains[d].range > 0) {
+            delta += rapl_domains[d].range;
+        }
+        total += delta;
+    }
+    return total * 1e-6;
+}
+
+// Energy of a stage, printed under its time line when --energy is on
+void printStageEnergy(const char *stage, const EnergySample *start, double seconds) {
+    if (!energy_enabled) {
+        return;
+    }
+    double joules = energyJoulesSince(start);
+    if (joules < 0.0) {
+        printf("%s Energy: unavailable\n", stage);
+    } else {
+        printf("%s Energy: %.4f joules (%.2f watts)\n", stage, joules, seconds > 0.0 ? joules / seconds : 0.0);
+    }
+}
+
+#ifdef __linux__
+static int perfEventOpen(struct perf_event_attr *attr) {
+    return (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, 0); // Calling thread, any CPU
+}
+#endif
+
+// Open LLC miss counters on every thread of the parallel loops, for loads or, with stores
+// set, for the read-for-ownership of stores. Returns 0 (and the counter reads as
+// unavailable) when the kernel or the CPU does not provide them.
+int llcCounterOpen(LlcMissCounter *counter, int stores) {
+    counter->num_fds = maxThreads();
+    counter->fds = (int *)malloc(counter->num_fds * sizeof(int));
+    if (!counter->fds) {
+        counter->num_fds = 0;
+        return 0;
+    }
+    for (int t = 0; t < counter->num_fds; t++) {
+        counter->fds[t] = -1;
+    }
+#ifdef __linux__
+    int available = 1;
+    #pragma omp parallel reduction(&&:available)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL |
+                      ((stores ? PERF_COUNT_HW_CACHE_OP_WRITE : PERF_COUNT_HW_CACHE_OP_READ) << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int thread = 0;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+#endif
+        counter->fds[thread] = perfEventOpen(&attr);
+        available = counter->fds[thread] >= 0;
+    }
+    if (available) {
+        return 1;
+    }
+#endif
+    for (int t = 0; t < counter->num_fds; t++) {
+        if (counter->fds[t] >= 0) {
+            close(counter->fds[t]);
+        }
+    }
+    free(counter->fds);
+    counter->fds = NULL;
+    counter->num_fds = 0;
+    return 0;
+}
+
+void llcCounterStart(LlcMissCounter *counter) {
+#ifdef __linux__
+    for (int t = 0; t < counter->num_fds; t++) {
+        ioctl(counter->fds[t], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter->fds[t], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)counter;
+#endif
+}
+
+// Stop the counters and return the misses summed over all threads, or -1 if unavailable
+long long llcCounterStop(LlcMissCounter *counter) {
+    if (counter->num_fds == 0) {
+        return -1;
+    }
+    long long total = 0;
+#ifdef __linux__
+    for (int t = 0; t < counter->num_fds; t++) {
+        long long value = 0;
+        ioctl(counter->fds[t], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter->fds[t], &value, sizeof(value)) != (ssize_t)sizeof(value)) {
+            return -1;
+        }
+        total += value;
+    }
+#endif
+    return total;
+}
+
+void llcCounterClose(LlcMissCounter *counter) {
+    for (int t = 0; t < counter->num_fds; t++) {
+        close(counter->fds[t]);
+    }
+    free(counter->fds);
+    counter->fds = NULL;
+    counter->num_fds = 0;
+}
+
+// Size of the last-level cache in bytes
+size_t llcBytes(void) {
+    static size_t cached = 0;
+    if (cached == 0) {
+#ifdef _SC_LEVEL3_CACHE_SIZE
+        long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        if (size > 0) {
+            cached = (size_t)size;
+        }
+#endif
+        if (cached == 0) {
+            FILE *file = fopen("/sys/devices/system/cpu/cpu0/cache/index3/size", "r");
+            unsigned long kilobytes = 0;
+            if (file) {
+                if (fscanf(file, "%luK", &kilobytes) == 1) {
+                    cached = (size_t)kilobytes << 10;
+                }
+                fclose(file);
+            }
+        }
+        if (cached == 0) {
+            cached = DEFAULT_LLC_BYTES;
+        }
+    }
+    return cached;
+}
+
+// Whether a writer of buffer_bytes should bypass the cache. Streaming stores pay off only
+// for whole cache lines, so the buffer and each of its rows must start on a line boundary.
+int useStreamingStores(const void *buffer, size_t buffer_bytes, int rows_line_aligned) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (non_temporal_mode == NT_NEVER || ((uintptr_t)buffer & (CACHE_LINE - 1)) != 0 || !rows_line_aligned) {
+        return 0;
+    }
+    return non_temporal_mode == NT_ALWAYS || buffer_bytes > llcBytes();
+#else
+    (void)buffer;
+    (void)buffer_bytes;
+    (void)rows_line_aligned;
+    return 0;
+#endif
+}
+
+// Order this thread's streaming stores before the end of the stage that wrote them
+static inline void streamingStoreFence(int streaming) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (streaming) {
+        _mm_sfence();
+    }
+#else
+    (void)streaming;
+#endif
+}
+
+// Store one float, around the cache when streaming
+static inline void storeFloat(float *destination, float value, int streaming) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (streaming) {
+        int bits;
+        memcpy(&bits, &value, sizeof(bits));
+        _mm_stream_si32((int *)destination, bits);
+        return;
+    }
+#else
+    (void)streaming;
+#endif
+    *destination = value;
+}
+
+// Helper: Allocate memory and handle failure
+void *safe_malloc(size_t size, const char *name) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        printf("Error: Memory allocation failed for %s.\n", name);
+        exit(1);
+    }
+    return ptr;
+}
+
+// Helper: Allocate cache-line aligned memory and handle failure
+void *safe_aligned_malloc(size_t size, const char *name) {
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, CACHE_LINE, size) != 0) {
+        printf("Error: Memory allocation failed for %s.\n", name);
+        exit(1);
+    }
+    return ptr;
+}
+
+// High-dynamic-range latency histogram with log-linear buckets: values below 2^HDR_SUB_BITS
+// get a bucket each, and each power of two above is split into 2^HDR_SUB_BITS equal buckets.
+// Each thread records into its own shard; readers merge the shards.
+typedef struct {
+    long long counts[HDR_BUCKETS];
+    long long sum; // Nanoseconds
+    long long max;
+} __attribute__((aligned(CACHE_LINE))) HdrShard;
+
+typedef struct {
+    HdrShard *shards; // METRIC_SHARDS shards
+} HdrHistogram;
+
+// Merged counts at one point in time; the difference of two is an interval
+typedef struct {
+    long long counts[HDR_BUCKETS];
+    long long total;
+    long long sum;
+    long long max;
+} HdrSnapshot;
+
+void hdrInit(HdrHistogram *histogram) {
+    histogram->shards = (HdrShard *)safe_aligned_malloc(METRIC_SHARDS * sizeof(HdrShard), "hdrShards");
+    memset(histogram->shards, 0, METRIC_SHARDS * sizeof(HdrShard));
+}
+
+void hdrFree(HdrHistogram *histogram) {
+    free(histogram->shards);
+    histogram->shards = NULL;
+}
+
+// Shard of the calling thread. Threads below METRIC_SHARDS - 1 own their shard, so their
+// updates are plain relaxed loads and stores (no locked instruction); the remaining threads
+// share the last shard and update it with atomic adds.
+static inline int metricShardIndex(void) {
+#ifdef _OPENMP
+    int thread = omp_get_thread_num();
+    return thread < METRIC_SHARDS - 1 ? thread : METRIC_SHARDS - 1;
+#else
+    return 0;
+#endif
+}
+
+static inline void shardAdd(long long *value, long long amount, int shard) {
+    if (shard == METRIC_SHARDS - 1) {
+        __atomic_fetch_add(value, amount, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+    }
+}
+
+static inline int hdrBucket(unsigned long long value) {
+    if (value >= (1ULL << HDR_MAX_BITS)) {
+        value = (1ULL << HDR_MAX_BITS) - 1;
+    }
+    if (value < (1ULL << HDR_SUB_BITS)) {
+        return (int)value;
+    }
+    int top = 63 - __builtin_clzll(value);
+    int shift = top - HDR_SUB_BITS;
+    return ((shift + 1) << HDR_SUB_BITS) + (int)((value >> shift) - (1ULL << HDR_SUB_BITS));
+}
+
+// Largest value that falls in a bucket
+static inline long long hdrBucketHigh(int bucket) {
+    if (bucket < (1 << HDR_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> HDR_SUB_BITS) - 1;
+    long long sub = (bucket & ((1 << HDR_SUB_BITS) - 1)) + (1LL << HDR_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void hdrRecord(HdrHistogram *histogram, long long nanoseconds) {
+    int index = metricShardIndex();
+    HdrShard *shard = &histogram->shards[index];
+    nanoseconds = nanoseconds < 0 ? 0 : nanoseconds;
+    shardAdd(&shard->counts[hdrBucket((unsigned long long)nanoseconds)], 1, index);
+    shardAdd(&shard->sum, nanoseconds, index);
+    long long max = __atomic_load_n(&shard->max, __ATOMIC_RELAXED);
+    while (nanoseconds > max &&
+           !__atomic_compare_exchange_n(&shard->max, &max, nanoseconds, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline long long nowNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void hdrSnapshot(const HdrHistogram *histogram, HdrSnapshot *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (int t = 0; t < METRIC_SHARDS; t++) {
+        const HdrShard *shard = &histogram->shards[t];
+        for (int b = 0; b < HDR_BUCKETS; b++) {
+            long long count = __atomic_load_n(&shard->counts[b], __ATOMIC_RELAXED);
+            snapshot->counts[b] += count;
+            snapshot->total += count;
+        }
+        snapshot->sum += __atomic_load_n(&shard->sum, __ATOMIC_RELAXED);
+        long long max = __atomic_load_n(&shard->max, __ATOMIC_RELAXED);
+        snapshot->max = max > snapshot->max ? max : snapshot->max;
+    }
+}
+
+// Records between two snapshots. The maximum of the interval is the top of its highest
+// bucket (capped at the overall maximum).
+void hdrInterval(const HdrSnapshot *now, const HdrSnapshot *before, HdrSnapshot *interval) {
+    interval->total = now->total - before->total;
+    interval->sum = now->sum - before->sum;
+    interval->max = 0;
+    for (int b = 0; b < HDR_BUCKETS; b++) {
+        interval->counts[b] = now->counts[b] - before->counts[b];
+        if (interval->counts[b] > 0) {
+            interval->max = hdrBucketHigh(b) < now->max ? hdrBucketHigh(b) : now->max;
+        }
+    }
+}
+
+// Value at quantile q (0..1): the top of the bucket holding that rank, capped at the maximum
+long long hdrQuantile(const HdrSnapshot *snapshot, double quantile) {
+    if (snapshot->total == 0) {
+        return 0;
+    }
+    long long rank = (long long)ceil(quantile * snapshot->total);
+    rank = rank < 1 ? 1 : rank;
+    long long seen = 0;
+    for (int b = 0; b < HDR_BUCKETS; b++) {
+        seen += snapshot->counts[b];
+        if (seen >= rank) {
+            return hdrBucketHigh(b) < snapshot->max ? hdrBucketHigh(b) : snapshot->max;
+        }
+    }
+    return snapshot->max;
+}
+
+void printLatencySummary(const char *label, const HdrSnapshot *snapshot) {
+    printf("%s: %lld samples, mean %.2f us, p50 %.2f us, p90 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n",
+           label, snapshot->total, snapshot->total > 0 ? snapshot->sum * 1e-3 / snapshot->total : 0.0,
+           hdrQuantile(snapshot, 0.5) * 1e-3, hdrQuantile(snapshot, 0.9) * 1e-3, hdrQuantile(snapshot, 0.99) * 1e-3,
+           hdrQuantile(snapshot, 0.999) * 1e-3, snapshot->max * 1e-3);
+}
+
+// Live metrics (--metrics FILE). Hot paths add to the shard of their OpenMP thread, so
+// threads never share a cache line; an exporter thread sums the shards and rewrites FILE
+// in the Prometheus text format every interval.
+typedef enum { METRIC_ROWS, METRIC_BYTES, METRIC_QUEUE_DEPTH, METRIC_BATCH_LATENCY, METRIC_TWEET_LATENCY, NUM_METRICS } MetricId;
+typedef enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM } MetricType;
+
+static const struct {
+    const char *name;
+    const char *help;
+    MetricType type;
+} metric_info[NUM_METRICS] = {
+    { "sentiment_rows_total", "Rows processed (records, tweets, windows) over all stages", METRIC_COUNTER },
+    { "sentiment_bytes_total", "Bytes of dataset or tweet text processed", METRIC_COUNTER },
+    { "sentiment_queue_depth", "Spilled chunks read ahead and waiting to be trained on", METRIC_GAUGE },
+    { "sentiment_batch_seconds", "Latency of one batch of a stage", METRIC_HISTOGRAM },
+    { "sentiment_tweet_seconds", "Latency of scoring one tweet on its own", METRIC_HISTOGRAM },
+};
+
+typedef struct {
+    long long value; // Counter or gauge value
+} __attribute__((aligned(CACHE_LINE))) MetricShard;
+
+int metrics_enabled = 0;
+MetricShard *metric_shards[NUM_METRICS];
+HdrHistogram metric_histograms[NUM_METRICS]; // Histogram metrics only
+
+// Stage progress for rates and the ETA, changed rarely and only under the lock
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    pthread_t thread;
+    int stopping;
+    const char *path;
+    double interval;
+    double start_time;
+    const char *stage;
+    long long stage_expected; // Rows the stage will process (0: unknown)
+    long long stage_base;     // METRIC_ROWS when the stage began
+    double stage_time;
+} MetricsExporter;
+
+MetricsExporter metrics_exporter;
+
+static inline void metricAdd(MetricId id, long long amount) {
+    if (metrics_enabled) {
+        int index = metricShardIndex();
+        shardAdd(&metric_shards[id][index].value, amount, index);
+    }
+}
+
+static inline void metricSet(MetricId id, long long value) {
+    if (metrics_enabled) {
+        __atomic_store_n(&metric_shards[id][0].value, value, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void metricRecordSeconds(MetricId id, double seconds) {
+    if (metrics_enabled) {
+        hdrRecord(&metric_histograms[id], (long long)(seconds * 1e9));
+    }
+}
+
+static long long metricValue(MetricId id) {
+    long long total = 0;
+    for (int t = 0; t < METRIC_SHARDS; t++) {
+        total += __atomic_load_n(&metric_shards[id][t].value, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Mark the start of a stage that will process expected rows (0 if not known up front)
+void metricsStage(const char *stage, long long expected) {
+    if (!metrics_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&metrics_exporter.lock);
+    metrics_exporter.stage = stage;
+    metrics_exporter.stage_expected = expected;
+    metrics_exporter.stage_base = metricValue(METRIC_ROWS);
+    metrics_exporter.stage_time = wallSeconds();
+    pthread_mutex_unlock(&metrics_exporter.lock);
+}
+
+// Write the metrics to a temporary file and rename it over the target, so readers never
+// see a partial file
+static void writeMetrics(double *last_time, long long *last_rows, long long *last_bytes) {
+    MetricsExporter *exporter = &metrics_exporter;
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", exporter->path);
+    FILE *file = fopen(temporary, "w");
+    if (!file) {
+        return;
+    }
+    double now = wallSeconds();
+    long long rows = metricValue(METRIC_ROWS), bytes = metricValue(METRIC_BYTES);
+    double elapsed = now - *last_time;
+    for (int id = 0; id < NUM_METRICS; id++) {
+        const char *type = metric_info[id].type == METRIC_COUNTER ? "counter"
+                         : metric_info[id].type == METRIC_GAUGE ? "gauge" : "summary";
+        fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", metric_info[id].name, metric_info[id].help, metric_info[id].name, type);
+        if (metric_info[id].type == METRIC_COUNTER) {
+            fprintf(file, "%s %lld\n", metric_info[id].name, metricValue((MetricId)id));
+        } else if (metric_info[id].type == METRIC_GAUGE) {
+            fprintf(file, "%s %lld\n", metric_info[id].name, __atomic_load_n(&metric_shards[id][0].value, __ATOMIC_RELAXED));
+        } else {
+            // HDR histograms are exported as summaries: their quantiles, sum, count and maximum
+            static HdrSnapshot snapshot;
+            static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+            hdrSnapshot(&metric_histograms[id], &snapshot);
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                fprintf(file, "%s{quantile=\"%g\"} %.9f\n", metric_info[id].name, quantiles[q],
+                        hdrQuantile(&snapshot, quantiles[q]) * 1e-9);
+            }
+            fprintf(file, "%s_sum %.9f\n%s_count %lld\n", metric_info[id].name, snapshot.sum * 1e-9,
+                    metric_info[id].name, snapshot.total);
+            fprintf(file, "# HELP %s_max Largest %s\n# TYPE %s_max gauge\n%s_max %.9f\n", metric_info[id].name,
+                    metric_info[id].name, metric_info[id].name, metric_info[id].name, snapshot.max * 1e-9);
+        }
+    }
+
+    fprintf(file, "# HELP sentiment_rows_per_second Rows per second over the last interval\n");
+    fprintf(file, "# TYPE sentiment_rows_per_second gauge\nsentiment_rows_per_second %.1f\n",
+            elapsed > 0.0 ? (rows - *last_rows) / elapsed : 0.0);
+    fprintf(file, "# HELP sentiment_bytes_per_second Bytes per second over the last interval\n");
+    fprintf(file, "# TYPE sentiment_bytes_per_second gauge\nsentiment_bytes_per_second %.1f\n",
+            elapsed > 0.0 ? (bytes - *last_bytes) / elapsed : 0.0);
+
+    pthread_mutex_lock(&exporter->lock);
+    const char *stage = exporter->stage ? exporter->stage : "starting";
+    long long stage_rows = rows - exporter->stage_base;
+    long long expected = exporter->stage_expected;
+    double stage_elapsed = now - exporter->stage_time;
+    pthread_mutex_unlock(&exporter->lock);
+    fprintf(file, "# HELP sentiment_stage_rows Rows processed and expected in the current stage\n");
+    fprintf(file, "# TYPE sentiment_stage_rows gauge\n");
+    fprintf(file, "sentiment_stage_rows{stage=\"%s\",kind=\"done\"} %lld\n", stage, stage_rows);
+    fprintf(file, "sentiment_stage_rows{stage=\"%s\",kind=\"expected\"} %lld\n", stage, expected);
+    fprintf(file, "# HELP sentiment_eta_seconds Estimated time left in the current stage (-1: unknown)\n");
+    fprintf(file, "# TYPE sentiment_eta_seconds gauge\nsentiment_eta_seconds{stage=\"%s\"} %.1f\n", stage,
+            expected > 0 && stage_rows > 0 ? (expected - stage_rows) * stage_elapsed / stage_rows : -1.0);
+    fprintf(file, "# HELP sentiment_uptime_seconds Time since the run started\n");
+    fprintf(file, "# TYPE sentiment_uptime_seconds gauge\nsentiment_uptime_seconds %.1f\n", now - exporter->start_time);
+    fclose(file);
+    rename(temporary, exporter->path);
+
+    *last_time = now;
+    *last_rows = rows;
+    *last_bytes = bytes;
+}
+
+static void *metricsExporterThread(void *arg) {
+    (void)arg;
+    MetricsExporter *exporter = &metrics_exporter;
+    double last_time = exporter->start_time;
+    long long last_rows = 0, last_bytes = 0;
+    int stopping = 0;
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long long nanoseconds = deadline.tv_nsec + (long long)(exporter->interval * 1e9);
+        deadline.tv_sec += nanoseconds / 1000000000LL;
+        deadline.tv_nsec = nanoseconds % 1000000000LL;
+        pthread_mutex_lock(&exporter->lock);
+        while (!exporter->stopping && pthread_cond_timedwait(&exporter->stop, &exporter->lock, &deadline) == 0) {
+        }
+        stopping = exporter->stopping;
+        pthread_mutex_unlock(&exporter->lock);
+        writeMetrics(&last_time, &last_rows, &last_bytes); // Once more on the way out
+    }
+    return NULL;
+}
+
+void metricsStart(const char *path, double interval) {
+    for (int id = 0; id < NUM_METRICS; id++) {
+        metric_shards[id] = (MetricShard *)safe_aligned_malloc(METRIC_SHARDS * sizeof(MetricShard), "metricShards");
+        memset(metric_shards[id], 0, METRIC_SHARDS * sizeof(MetricShard));
+        if (metric_info[id].type == METRIC_HISTOGRAM) {
+            hdrInit(&metric_histograms[id]);
+        }
+    }
+    pthread_mutex_init(&metrics_exporter.lock, NULL);
+    pthread_cond_init(&metrics_exporter.stop, NULL);
+    metrics_exporter.path = path;
+    metrics_exporter.interval = interval;
+    metrics_exporter.start_time = wallSeconds();
+    metrics_exporter.stage_time = metrics_exporter.start_time;
+    metrics_enabled = 1;
+    if (pthread_create(&metrics_exporter.thread, NULL, metricsExporterThread, NULL) != 0) {
+        printf("Error: Could not start the metrics exporter thread\n");
+        exit(1);
+    }
+}
+
+void metricsStop(void) {
+    if (!metrics_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&metrics_exporter.lock);
+    metrics_exporter.stopping = 1;
+    pthread_cond_signal(&metrics_exporter.stop);
+    pthread_mutex_unlock(&metrics_exporter.lock);
+    pthread_join(metrics_exporter.thread, NULL);
+    pthread_mutex_destroy(&metrics_exporter.lock);
+    pthread_cond_destroy(&metrics_exporter.stop);
+    metrics_enabled = 0;
+    for (int id = 0; id < NUM_METRICS; id++) {
+        free(metric_shards[id]);
+        hdrFree(&metric_histograms[id]);
+    }
+}
+
+// Counter-based RNG: 10 rounds of Philox4x32 turn (counter, key) into 4 random words.
+// Every output depends only on its counter, so any index can be generated independently.
+static inline void philox4x32(const uint32_t ctr_in[4], uint64_t seed, uint32_t out[4]) {
+    uint32_t c0 = ctr_in[0], c1 = ctr_in[1], c2 = ctr_in[2], c3 = ctr_in[3];
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Draw the 4 random words for block `index` of stream `stream`
+static inline void philoxBlock(uint64_t seed, uint32_t stream, uint64_t index, uint32_t out[4]) {
+    uint32_t ctr[4] = { (uint32_t)index, (uint32_t)(index >> 32), stream, 0u };
+    philox4x32(ctr, seed, out);
+}
+
+// Map a random word to a float in (0, 1] (never 0, so it is safe for logf)
+static inline float philoxUniform(uint32_t x) {
+    return (float)((x >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+// Shuffle the dataset to randomize it (Fisher-Yates, driven by the run seed)
+void shuffleDataset(LegacyPost *dataset, int num_samples, uint64_t seed) {
+    for (int i = num_samples - 1; i > 0; i--) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_SHUFFLE, (uint64_t)i, r);
+        int j = (int)(((uint64_t)r[0] * (uint64_t)(i + 1)) >> 32); // Uniform in [0, i]
+        // Swap elements
+        LegacyPost temp = dataset[i];
+        dataset[i] = dataset[j];
+        dataset[j] = temp;
+    }
+}
+
+// The same shuffle applied to record indices: the dataset ends up in the same order
+void shuffleIndices(int *indices, int num_samples, uint64_t seed) {
+    for (int i = num_samples - 1; i > 0; i--) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_SHUFFLE, (uint64_t)i, r);
+        int j = (int)(((uint64_t)r[0] * (uint64_t)(i + 1)) >> 32); // Uniform in [0, i]
+        int temp = indices[i];
+        indices[i] = indices[j];
+        indices[j] = temp;
+    }
+}
+
+void freeDatasetArena(void) {
+    if (dataset_arena.mapped) {
+        munmap(dataset_arena.data, dataset_arena.size);
+    } else {
+        free(dataset_arena.data);
+    }
+    dataset_arena.data = NULL;
+    dataset_arena.size = 0;
+    dataset_arena.mapped = 0;
+}
+
+// Load dataset from file
+int loadDataset(const char *filename, LegacyPost **dataset) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Error: Could not open file %s\n", filename);
+        exit(1);
+    }
+
+    size_t capacity = 1000;
+    size_t count = 0;
+    *dataset = (LegacyPost *)safe_malloc(capacity * sizeof(LegacyPost), "dataset");
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        if (count >= capacity) {
+            capacity *= 2;
+            *dataset = (LegacyPost *)realloc(*dataset, capacity * sizeof(LegacyPost));
+            if (!*dataset) {
+                printf("Error: Memory reallocation failed.\n");
+                fclose(file);
+                exit(1);
+            }
+        }
+
+        // Read label (first column of dataset)
+        char *token = strtok(line, ",");
+        if (!token) continue;
+
+        (*dataset)[count].label = atoi(token);  // Use numeric labels (0 for negative, 4 for positive)
+
+        // Skip unnecessary columns (3rd, 4th, and 5th columns)
+        token = strtok(NULL, ",");
+        for (int i = 0; i < 3; i++) {
+            token = strtok(NULL, ",");
+        }
+
+        // Read the tweet content (last column)
+        token = strtok(NULL, "\n");
+        if (token) {
+            strncpy((*dataset)[count].text, token, MAX_TOKENS - 1);
+            (*dataset)[count].text[MAX_TOKENS - 1] = '\0';
+            count++;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Load, shuffle and split with the line-by-line loader (kept for --bench-loader). The
+// fixed-size records are copied into an arena at the end so the split holds text views.
+int loadAndSplitDatasetLegacy(const char *filename, Post **trainSet, Post **testSet, int *trainSize, int *testSize, uint64_t seed) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+    LegacyPost *dataset = NULL;
+    int num_samples = loadDataset(filename, &dataset);  // Load entire dataset
+
+    // Shuffle the dataset to randomize the order
+    shuffleDataset(dataset, num_samples, seed);
+
+    // Split into 70% training and 30% testing
+    *trainSize = (int)(num_samples * 0.7);
+    *testSize = num_samples - *trainSize;
+
+    // Allocate memory for the training and testing sets
+    *trainSet = (Post *)safe_malloc(*trainSize * sizeof(Post), "trainSet");
+    *testSet = (Post *)safe_malloc(*testSize * sizeof(Post), "testSet");
+
+    // Copy the data into the train and test sets
+    size_t arena_size = 1;
+    for (int i = 0; i < num_samples; i++) {
+        arena_size += strlen(dataset[i].text);
+    }
+    char *arena = (char *)safe_malloc(arena_size, "legacyArena");
+    size_t used = 0;
+    for (int i = 0; i < num_samples; i++) {
+        Post *post = i < *trainSize ? &(*trainSet)[i] : &(*testSet)[i - *trainSize];
+        int length = (int)strlen(dataset[i].text);
+        memcpy(arena + used, dataset[i].text, length);
+        post->text.data = arena + used;
+        post->text.length = length;
+        post->label = dataset[i].label;
+        post->record = -1; // Other columns are not kept
+        used += length;
+    }
+    freeDatasetArena();
+    dataset_arena.data = arena;
+    dataset_arena.size = used;
+    dataset_arena.mapped = 0;
+
+    free(dataset);  // Free the original dataset after splitting
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Loading and Splitting Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Loading and Splitting", &start_energy, execution_time);
+
+    return num_samples;
+}
+
+// Find the newlines that end CSV records (those outside double quotes) in data[0, length).
+// inside_quotes is the quote state at data[0] and receives the state after the last byte.
+// Returns the number of record ends; their offsets (plus base) go to ends unless it is NULL.
+// newlines receives the number of newlines, quoted or not.
+static long long scanRecordEndsScalar(const char *data, size_t length, int *inside_quotes, long long base,
+                                      long long *ends, long long *newlines) {
+    int inside = *inside_quotes;
+    long long count = 0, total = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == '"') {
+            inside ^= 1;
+        } else if (data[i] == '\n') {
+            total++;
+            if (!inside) {
+                if (ends) {
+                    ends[count] = base + (long long)i;
+                }
+                count++;
+            }
+        }
+    }
+    *inside_quotes = inside;
+    *newlines = total;
+    return count;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// AVX2 version: 32 bytes per step. The quote state of every byte is the prefix XOR of the
+// quote bitmask, carried from one block to the next.
+__attribute__((target("avx2,popcnt,bmi"))) static long long scanRecordEndsAvx2(const char *data, size_t length, int *inside_quotes,
+                                                                               long long base, long long *ends, long long *newlines) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    uint32_t carry = *inside_quotes ? 0xFFFFFFFFu : 0u;
+    long long count = 0, total = 0;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint32_t quotes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, quote));
+        uint32_t lines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        uint32_t inside = quotes;
+        inside ^= inside << 1;
+        inside ^= inside << 2;
+        inside ^= inside << 4;
+        inside ^= inside << 8;
+        inside ^= inside << 16;
+        inside ^= carry;
+        uint32_t record_ends = lines & ~inside;
+        total += __builtin_popcount(lines);
+        if (ends) {
+            while (record_ends) {
+                ends[count++] = base + (long long)(i + __builtin_ctz(record_ends));
+                record_ends &= record_ends - 1;
+            }
+        } else {
+            count += __builtin_popcount(record_ends);
+        }
+        carry = (uint32_t)((int32_t)inside >> 31);
+    }
+    int inside = carry != 0;
+    long long tail_total;
+    count += scanRecordEndsScalar(data + i, length - i, &inside, base + (long long)i, ends ? ends + count : NULL, &tail_total);
+    *inside_quotes = inside;
+    *newlines = total + tail_total;
+    return count;
+}
+#endif
+
+// Record scanner used by the loader, picked for the running CPU by selectScanKernel
+static long long (*scanRecordEnds)(const char *, size_t, int *, long long, long long *, long long *) = scanRecordEndsScalar;
+
+void selectScanKernel(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi")) {
+        scanRecordEnds = scanRecordEndsAvx2;
+        return;
+    }
+#endif
+}
+
+// Next comma-separated field of a record, skipping empty fields like strtok(..., ",")
+static const char *nextField(const char *cursor, const char *end, const char **field_end) {
+    while (cursor < end && *cursor == ',') {
+        cursor++;
+    }
+    if (cursor == end) {
+        return NULL;
+    }
+    const char *field = cursor;
+    while (cursor < end && *cursor != ',') {
+        cursor++;
+    }
+    *field_end = cursor;
+    return field;
+}
+
+// atoi of a field that is not NUL-terminated
+static int parseInt(const char *field, const char *end) {
+    while (field < end && (*field == ' ' || (*field >= '\t' && *field <= '\r'))) {
+        field++;
+    }
+    int sign = 1;
+    if (field < end && (*field == '-' || *field == '+')) {
+        sign = *field++ == '-' ? -1 : 1;
+    }
+    int value = 0;
+    while (field < end && *field >= '0' && *field <= '9') {
+        value = value * 10 + (*field++ - '0');
+    }
+    return sign * value;
+}
+
+// Parse one record [begin, end) the way the line-by-line loader does: the label is the
+// first field, four fields are skipped and the tweet is the rest of the record
+static void parseRecord(const char *begin, const char *end, RecordSpan *span) {
+    const char *field_end = begin;
+    span->text_length = -1;
+    const char *field = nextField(begin, end, &field_end);
+    if (!field) {
+        return;
+    }
+    span->label = parseInt(field, field_end);
+    for (int i = 0; i < NUM_LAZY_FIELDS; i++) {
+        field = nextField(field_end, end, &field_end);
+        if (!field) {
+            return;
+        }
+        span->fields[i] = (uint32_t)(field - begin); // Only the offset: parsed on demand
+    }
+    if (field_end == end) {
+        return; // No tweet after the user field
+    }
+    const char *text = field_end + 1;
+    while (text < end && *text == '\n') {
+        text++;
+    }
+    if (text == end) {
+        return;
+    }
+    span->text_offset = text - begin;
+    span->text_length = (int)(end - text);
+}
+
+// Load, shuffle and split the dataset. The file is memory mapped and prescanned for record
+// ends in parallel, so every array is allocated once at its exact size. Records are parsed
+// in parallel and written straight to their shuffled place in the training or test set.
+// Tweets are views into the mapping (dataset_arena), which stays mapped for the run. Only
+// the label and the tweet are parsed; the other columns are read later with postField.
+// The split matches loadAndSplitDatasetLegacy for the same seed, except that tweets are no
+// longer truncated to MAX_TOKENS - 1 bytes.
+int loadAndSplitDataset(const char *filename, Post **trainSet, Post **testSet, int *trainSize, int *testSize, uint64_t seed) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    int fd = open(filename, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        printf("Error: Could not open file %s\n", filename);
+        exit(1);
+    }
+    size_t size = (size_t)file_stat.st_size;
+    char *data = NULL;
+    if (size > 0) {
+        data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Error: Could not map file %s\n", filename);
+            exit(1);
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Prescan: each chunk counts its record ends for both possible starting quote states,
+    // then a sequential pass over the chunks fixes the states and output positions
+    selectScanKernel();
+    metricsStage("load", 0);
+    int num_chunks = (int)((size + SCAN_CHUNK - 1) / SCAN_CHUNK);
+    long long *chunk_ends = (long long *)safe_malloc((num_chunks + 1) * sizeof(long long), "chunkEnds");
+    long long *chunk_newlines = (long long *)safe_malloc((num_chunks + 1) * sizeof(long long), "chunkNewlines");
+    int *chunk_state = (int *)safe_malloc((num_chunks + 1) * sizeof(int), "chunkState");
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < num_chunks; c++) {
+        size_t begin = (size_t)c * SCAN_CHUNK;
+        size_t length = size - begin < SCAN_CHUNK ? size - begin : SCAN_CHUNK;
+        int parity = 0;
+        chunk_ends[c] = scanRecordEnds(data + begin, length, &parity, 0, NULL, &chunk_newlines[c]);
+        chunk_state[c] = parity; // Quote parity of the chunk
+        metricAdd(METRIC_BYTES, (long long)length);
+    }
+    long long num_records = 0;
+    int inside = 0;
+    for (int c = 0; c < num_chunks; c++) {
+        int parity = chunk_state[c];
+        long long count = inside ? chunk_newlines[c] - chunk_ends[c] : chunk_ends[c];
+        chunk_state[c] = inside;
+        chunk_ends[c] = num_records;
+        num_records += count;
+        inside ^= parity;
+    }
+    int trailing = size > 0 && data[size - 1] != '\n'; // Last record without a newline
+    long long *ends = (long long *)safe_malloc((num_records + trailing + 1) * sizeof(long long), "recordEnds");
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < num_chunks; c++) {
+        size_t begin = (size_t)c * SCAN_CHUNK;
+        size_t length = size - begin < SCAN_CHUNK ? size - begin : SCAN_CHUNK;
+        int state = chunk_state[c];
+        long long newlines;
+        scanRecordEnds(data + begin, length, &state, (long long)begin, ends + chunk_ends[c], &newlines);
+    }
+    if (trailing) {
+        ends[num_records++] = (long long)size;
+    }
+    free(chunk_ends);
+    free(chunk_newlines);
+    free(chunk_state);
+
+    // Parse every record, then keep the ones with a tweet
+    RecordSpan *spans = (RecordSpan *)safe_malloc((num_records + 1) * sizeof(RecordSpan), "recordSpans");
+    metricsStage("parse", num_records);
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (long long r = 0; r < num_records; r++) {
+        long long begin = r == 0 ? 0 : ends[r - 1] + 1;
+        parseRecord(data + begin, data + ends[r], &spans[r]);
+        spans[r].record_offset = begin;
+        spans[r].text_offset += begin;
+        metricAdd(METRIC_ROWS, 1);
+    }
+    free(ends);
+    int num_samples = 0;
+    for (long long r = 0; r < num_records; r++) {
+        if (spans[r].text_length >= 0) {
+            spans[num_samples++] = spans[r];
+        }
+    }
+
+    // Shuffle the record order and split into 70% training and 30% testing
+    int *order = (int *)safe_malloc((num_samples + 1) * sizeof(int), "recordOrder");
+    for (int i = 0; i < num_samples; i++) {
+        order[i] = i;
+    }
+    shuffleIndices(order, num_samples, seed);
+    *trainSize = (int)(num_samples * 0.7);
+    *testSize = num_samples - *trainSize;
+    *trainSet = (Post *)safe_malloc(*trainSize * sizeof(Post), "trainSet");
+    *testSet = (Post *)safe_malloc(*testSize * sizeof(Post), "testSet");
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_samples; i++) {
+        const RecordSpan *span = &spans[order[i]];
+        Post *post = i < *trainSize ? &(*trainSet)[i] : &(*testSet)[i - *trainSize];
+        post->label = span->label;
+        post->text.data = data + span->text_offset;
+        post->text.length = span->text_length;
+        post->record = span->record_offset;
+        memcpy(post->fields, span->fields, sizeof(post->fields));
+    }
+
+    free(order);
+    free(spans);
+    // The mapping stays as the arena that tweets and lazy columns are read from
+    freeDatasetArena();
+    dataset_arena.data = data;
+    dataset_arena.size = size;
+    dataset_arena.mapped = 1;
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Loading and Splitting Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Loading and Splitting", &start_energy, execution_time);
+
+    return num_samples;
+}
+
+// A lazy column of a post, read from the dataset arena: returns its first byte and sets
+// length, or returns NULL when the post's record was not kept
+const char *postField(const Post *post, PostField field, int *length) {
+    if (post->record < 0 || !dataset_arena.data) {
+        return NULL;
+    }
+    const char *begin = dataset_arena.data + post->record + post->fields[field];
+    const char *arena_end = dataset_arena.data + dataset_arena.size;
+    const char *end = begin;
+    while (end < arena_end && *end != ',' && *end != '\n') {
+        end++;
+    }
+    *length = (int)(end - begin);
+    return begin;
+}
+
+// Pairwise sum of n doubles with a fixed tree shape: split at the largest power of two
+// below n until a leaf is reached, then add the leaf left to right
+double pairwiseSum(const double *values, long long n) {
+    if (n <= REDUCE_LEAF) {
+        double sum = 0.0;
+        for (long long i = 0; i < n; i++) {
+            sum += values[i];
+        }
+        return sum;
+    }
+    long long half = 1;
+    while (half * 2 < n) {
+        half *= 2;
+    }
+    return pairwiseSum(values, half) + pairwiseSum(values + half, n - half);
+}
+
+// Pairwise sum of n floats (accumulated in double) with the same tree shape as pairwiseSum
+double pairwiseSumFloat(const float *values, long long n) {
+    if (n <= REDUCE_LEAF) {
+        double sum = 0.0;
+        for (long long i = 0; i < n; i++) {
+            sum += values[i];
+        }
+        return sum;
+    }
+    long long half = 1;
+    while (half * 2 < n) {
+        half *= 2;
+    }
+    return pairwiseSumFloat(values, half) + pairwiseSumFloat(values + half, n - half);
+}
+
+// Number of REDUCE_CHUNK sized partial sums a parallel reduction over n values produces
+long long reduceNumChunks(long long n) {
+    return (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+}
+
+// Deterministic parallel sum: every chunk is reduced by one thread with a fixed tree,
+// then the per-chunk partials are combined with the same tree
+double deterministicSum(const float *values, long long n) {
+    long long num_chunks = reduceNumChunks(n);
+    if (num_chunks <= 1) {
+        return pairwiseSumFloat(values, n);
+    }
+    double *partials = (double *)safe_malloc(num_chunks * sizeof(double), "partials");
+    #pragma omp parallel for schedule(static)
+    for (long long c = 0; c < num_chunks; c++) {
+        long long begin = c * REDUCE_CHUNK;
+        long long len = n - begin < REDUCE_CHUNK ? n - begin : REDUCE_CHUNK;
+        partials[c] = pairwiseSumFloat(values + begin, len);
+    }
+    double sum = pairwiseSum(partials, num_chunks);
+    free(partials);
+    return sum;
+}
+
+// Deterministic parallel dot product, reduced with the same fixed shape as deterministicSum
+double deterministicDot(const float *a, const float *b, long long n) {
+    long long num_chunks = reduceNumChunks(n);
+    double *partials = (double *)safe_malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(double), "partials");
+    #pragma omp parallel for schedule(static)
+    for (long long c = 0; c < num_chunks; c++) {
+        long long begin = c * REDUCE_CHUNK;
+        long long len = n - begin < REDUCE_CHUNK ? n - begin : REDUCE_CHUNK;
+        double leaves[REDUCE_CHUNK / REDUCE_LEAF];
+        int num_leaves = 0;
+        for (long long l = 0; l < len; l += REDUCE_LEAF) {
+            double sum = 0.0;
+            for (long long i = l; i < len && i < l + REDUCE_LEAF; i++) {
+                sum += (double)a[begin + i] * b[begin + i];
+            }
+            leaves[num_leaves++] = sum;
+        }
+        partials[c] = pairwiseSum(leaves, num_leaves);
+    }
+    double sum = pairwiseSum(partials, num_chunks);
+    free(partials);
+    return sum;
+}
+
+// Byte-class lookup for SIMD delimiter detection: a byte is a token character when
+// byte_class_low[low nibble] & byte_class_high[high nibble] is non-zero. Built from
+// isTokenChar by initByteClasses (one bit per distinct set of low nibbles).
+static uint8_t byte_class_low[16], byte_class_high[16];
+
+// Bit i of the result is set when text[i] (i < length <= 32) is a token character
+static uint32_t tokenMaskScalar(const char *text, int length) {
+    uint32_t mask = 0;
+    for (int i = 0; i < length; i++) {
+        mask |= (uint32_t)isTokenChar((unsigned char)text[i]) << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// AVX2 version: two nibble lookups classify 32 bytes at once. Short blocks are copied to
+// a padded buffer so nothing past the text is read.
+__attribute__((target("avx2"))) static uint32_t tokenMaskAvx2(const char *text, int length) {
+    char padded[32];
+    if (length < 32) {
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, text, length);
+        text = padded;
+    }
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_class_low));
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)byte_class_high));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)text);
+    __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, nibble));
+    __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+    __m256i delimiter = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+    return ~(uint32_t)_mm256_movemask_epi8(delimiter) & (length < 32 ? (1u << length) - 1u : 0xFFFFFFFFu);
+}
+#endif
+
+// Token mask kernel used by hashTokens, picked by initByteClasses
+static uint32_t (*tokenMask)(const char *, int) = tokenMaskScalar;
+
+// Build the nibble tables and pick the token mask kernel for the running CPU. Safe to call
+// more than once; call it before tokenizing (main and scoreTweet do).
+void initByteClasses(void) {
+    static int initialized = 0;
+    if (initialized) {
+        return;
+    }
+    initialized = 1;
+    uint16_t rows[16]; // Token low nibbles for each high nibble
+    int num_classes = 0;
+    uint16_t classes[8];
+    memset(byte_class_low, 0, sizeof(byte_class_low));
+    memset(byte_class_high, 0, sizeof(byte_class_high));
+    for (int high = 0; high < 16; high++) {
+        rows[high] = 0;
+        for (int low = 0; low < 16; low++) {
+            rows[high] |= (uint16_t)(isTokenChar((unsigned char)(high << 4 | low)) << low);
+        }
+        if (rows[high] == 0) {
+            continue;
+        }
+        int c = 0;
+        while (c < num_classes && classes[c] != rows[high]) {
+            c++;
+        }
+        if (c == num_classes) {
+            if (num_classes == 8) {
+                return; // Too many classes for one byte: keep the scalar kernel
+            }
+            classes[num_classes++] = rows[high];
+        }
+        byte_class_high[high] |= (uint8_t)(1u << c);
+        for (int low = 0; low < 16; low++) {
+            if (rows[high] >> low & 1) {
+                byte_class_low[low] |= (uint8_t)(1u << c);
+            }
+        }
+    }
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        tokenMask = tokenMaskAvx2;
+    }
+#endif
+}
+
+// Hash the lowercased word tokens of a text (FNV-1a), writing at most max_hashes hashes.
+// Token boundaries come from 32-byte token masks. Returns the number of tokens written.
+int hashTokens(StringView text, uint32_t *hashes, int max_hashes) {
+    int count = 0;
+    uint32_t hash = 2166136261u;
+    int in_token = 0;
+    for (int base = 0; base < text.length; base += 32) {
+        const char *block = text.data + base;
+        int length = text.length - base < 32 ? text.length - base : 32;
+        uint32_t mask = tokenMask(block, length);
+        int j = 0;
+        while (j < length) {
+            if (!in_token) {
+                uint32_t rest = mask >> j;
+                if (rest == 0) {
+                    break; // Only delimiters left in this block
+                }
+                j += __builtin_ctz(rest);
+                hash = 2166136261u;
+                in_token = 1;
+            }
+            uint32_t delimiters = ~mask >> j; // Bits past the block are delimiters too
+            int end = delimiters ? j + __builtin_ctz(delimiters) : 32;
+            end = end < length ? end : length;
+            for (; j < end; j++) {
+                unsigned char c = (unsigned char)block[j];
+                if (c >= 'A' && c <= 'Z') {
+                    c = (unsigned char)(c - 'A' + 'a');
+                }
+                hash = (hash ^ c) * 16777619u;
+            }
+            if (end < length) {
+                if (count < max_hashes) {
+                    hashes[count++] = hash;
+                }
+                in_token = 0;
+            }
+        }
+    }
+    if (in_token && count < max_hashes) {
+        hashes[count++] = hash;
+    }
+    return count;
+}
+
+// 64-bit SimHash of a tweet's word tokens: every token's (mixed) hash votes +1 or -1 on
+// each bit and the signature keeps the sign of the votes
+uint64_t simHashTweet(StringView text) {
+    uint32_t hashes[MAX_TOKENS];
+    int count = hashTokens(text, hashes, MAX_TOKENS);
+    int votes[64] = {0};
+    for (int t = 0; t < count; t++) {
+        // splitmix64 finalizer spreads the 32-bit token hash over 64 bits
+        uint64_t x = (uint64_t)hashes[t] * 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        x ^= x >> 31;
+        for (int bit = 0; bit < 64; bit++) {
+            votes[bit] += ((x >> bit) & 1u) ? 1 : -1;
+        }
+    }
+    uint64_t signature = 0;
+    for (int bit = 0; bit < 64; bit++) {
+        if (votes[bit] > 0) {
+            signature |= 1ull << bit;
+        }
+    }
+    return signature;
+}
+
+// Write one tweet's embedded characters as a full row of feature_size values, zero padded
+// past the end of the text. When streaming, the cache lines after the text are written
+// with non-temporal stores (the row must start on a cache line).
+static inline void embedRow(float *row, const char *text, int length, int streaming) {
+    if (length > feature_size) {
+        length = feature_size;
+    }
+    int padding_end = feature_size;
+#if defined(__x86_64__) && defined(__GNUC__)
+    int stream_start = feature_size;
+    if (streaming) {
+        // First cache line boundary after the text
+        const int line_floats = CACHE_LINE / (int)sizeof(float);
+        stream_start = (length + line_floats - 1) / line_floats * line_floats;
+        padding_end = stream_start < feature_size ? stream_start : feature_size;
+    }
+#else
+    (void)streaming;
+#endif
+    for (int j = 0; j < length; j++) {
+        row[j] = (float)(text[j]) / 255.0f;
+    }
+    memset(row + length, 0, (size_t)(padding_end - length) * sizeof(float));
+#if defined(__x86_64__) && defined(__GNUC__)
+    for (int j = stream_start; j < feature_size; j += 4) {
+        _mm_stream_ps(row + j, _mm_setzero_ps());
+    }
+#endif
+}
+
+// Modified tokenization using hash function (previously used ASCII values)
+// When signatures is not NULL it also receives the SimHash of every tweet, computed while
+// the tweet is still in cache.
+void tokenizeAndEmbed(Post *dataset, float *token_ids, int num_samples, uint64_t *signatures) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    // The token matrix is read again only by the dense layer, long after it has left the
+    // cache, so a matrix larger than the cache is written around it
+    int streaming = useStreamingStores(token_ids, (size_t)num_samples * feature_size * sizeof(float),
+                                       (feature_size * sizeof(float)) % CACHE_LINE == 0);
+    metricsStage("tokenize", num_samples);
+    int num_batches = (num_samples + TOKENIZE_BATCH - 1) / TOKENIZE_BATCH;
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (int b = 0; b < num_batches; b++) {
+            double batch_start = metrics_enabled ? wallSeconds() : 0.0;
+            int end = (b + 1) * TOKENIZE_BATCH < num_samples ? (b + 1) * TOKENIZE_BATCH : num_samples;
+            long long bytes = 0;
+            for (int i = b * TOKENIZE_BATCH; i < end; i++) {
+                embedRow(token_ids + (size_t)i * feature_size, dataset[i].text.data, dataset[i].text.length, streaming);
+                if (signatures) {
+                    signatures[i] = simHashTweet(dataset[i].text);
+                }
+                bytes += dataset[i].text.length;
+            }
+            if (metrics_enabled) {
+                metricAdd(METRIC_ROWS, end - b * TOKENIZE_BATCH);
+                metricAdd(METRIC_BYTES, bytes);
+                metricRecordSeconds(METRIC_BATCH_LATENCY, wallSeconds() - batch_start);
+            }
+        }
+        streamingStoreFence(streaming);
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Tokenization Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Tokenization", &start_energy, execution_time);
+}
+
+// A feature store is a shared segment holding the token matrices and labels of one dataset
+// split, so that several processes on a host tokenize the dataset once. It is a POSIX shared
+// memory object (/dev/shm/NAME), or a file-backed mapping when NAME contains a '/'.
+typedef struct {
+    uint32_t magic;
+    int32_t feature_size;
+    uint64_t seed;
+    int64_t dataset_bytes;  // Size and modification time of the dataset the features came from
+    int64_t dataset_mtime;
+    int32_t train_size;
+    int32_t test_size;
+    int32_t ready;          // Set by the publisher, with release ordering, once the features are complete
+    int32_t refcount;       // Processes attached, including the publisher
+    uint64_t train_features; // Byte offsets of the sections, cache-line aligned
+    uint64_t test_features;
+    uint64_t train_labels;
+    uint64_t test_labels;
+    uint64_t size;
+} FeatureStoreHeader;
+
+typedef struct {
+    FeatureStoreHeader *header;
+    const char *name;
+    float *train_features;
+    float *test_features;
+    int *train_labels;
+    int *test_labels;
+} FeatureStore;
+
+static int featureStoreOpen(const char *name, int flags) {
+    if (strchr(name, '/')) {
+        return open(name, flags, 0600);
+    }
+    char shm_name[256];
+    snprintf(shm_name, sizeof(shm_name), "/%s", name);
+    return shm_open(shm_name, flags, 0600);
+}
+
+static void featureStoreUnlink(const char *name) {
+    if (strchr(name, '/')) {
+        unlink(name);
+    } else {
+        char shm_name[256];
+        snprintf(shm_name, sizeof(shm_name), "/%s", name);
+        shm_unlink(shm_name);
+    }
+}
+
+static void featureStoreSections(FeatureStore *store) {
+    char *base = (char *)store->header;
+    store->train_features = (float *)(base + store->header->train_features);
+    store->test_features = (float *)(base + store->header->test_features);
+    store->train_labels = (int *)(base + store->header->train_labels);
+    store->test_labels = (int *)(base + store->header->test_labels);
+}
+
+static inline uint64_t alignToLine(uint64_t offset) {
+    return (offset + CACHE_LINE - 1) & ~(uint64_t)(CACHE_LINE - 1);
+}
+
+// Create the store for a split and map it. Returns 0 if another process created it first.
+// The caller fills the sections and then calls featureStorePublish.
+int featureStoreCreate(FeatureStore *store, const char *name, const struct stat *dataset, uint64_t seed,
+                       int train_size, int test_size) {
+    int fd = featureStoreOpen(name, O_RDWR | O_CREAT | O_EXCL);
+    if (fd < 0) {
+        if (errno == EEXIST) {
+            return 0;
+        }
+        printf("Error: Could not create feature store %s\n", name);
+        exit(1);
+    }
+    FeatureStoreHeader layout = {0};
+    layout.train_features = alignToLine(sizeof(FeatureStoreHeader));
+    layout.test_features = alignToLine(layout.train_features + (uint64_t)train_size * feature_size * sizeof(float));
+    layout.train_labels = alignToLine(layout.test_features + (uint64_t)test_size * feature_size * sizeof(float));
+    layout.test_labels = alignToLine(layout.train_labels + (uint64_t)train_size * sizeof(int));
+    layout.size = layout.test_labels + (uint64_t)test_size * sizeof(int);
+    if (ftruncate(fd, (off_t)layout.size) != 0) {
+        printf("Error: Could not size feature store %s (%.1f MB)\n", name, layout.size / 1e6);
+        featureStoreUnlink(name);
+        exit(1);
+    }
+    void *base = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Error: Could not map feature store %s\n", name);
+        featureStoreUnlink(name);
+        exit(1);
+    }
+
+    layout.magic = FEATURE_STORE_MAGIC;
+    layout.feature_size = feature_size;
+    layout.seed = seed;
+    layout.dataset_bytes = (int64_t)dataset->st_size;
+    layout.dataset_mtime = (int64_t)dataset->st_mtime;
+    layout.train_size = train_size;
+    layout.test_size = test_size;
+    layout.refcount = 1;
+    memcpy(base, &layout, sizeof(layout));
+    store->header = (FeatureStoreHeader *)base;
+    store->name = name;
+    featureStoreSections(store);
+    return 1;
+}
+
+void featureStorePublish(FeatureStore *store) {
+    __atomic_store_n(&store->header->ready, 1, __ATOMIC_RELEASE);
+    printf("Feature Store: published %s (%.1f MB)\n", store->name, store->header->size / 1e6);
+}
+
+// Attach to an existing store, waiting for its publisher to finish. Returns 0 if there is
+// no store of that name. A store built from another dataset, seed or feature size is an error.
+int featureStoreAttach(FeatureStore *store, const char *name, const struct stat *dataset, uint64_t seed) {
+    int fd = featureStoreOpen(name, O_RDWR);
+    if (fd < 0) {
+        return 0;
+    }
+    double start_time = wallSeconds();
+    struct stat file_stat;
+    // The publisher sizes the segment right after creating it
+    while (fstat(fd, &file_stat) == 0 && (size_t)file_stat.st_size < sizeof(FeatureStoreHeader)) {
+        if (wallSeconds() - start_time > FEATURE_STORE_WAIT_SECONDS) {
+            printf("Error: Feature store %s was never sized; remove it and retry\n", name);
+            exit(1);
+        }
+        usleep(10000);
+    }
+    void *base = mmap(NULL, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Error: Could not map feature store %s\n", name);
+        exit(1);
+    }
+    FeatureStoreHeader *header = (FeatureStoreHeader *)base;
+    while (!__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE)) {
+        if (wallSeconds() - start_time > FEATURE_STORE_WAIT_SECONDS) {
+            printf("Error: Feature store %s was never published; remove it and retry\n", name);
+            exit(1);
+        }
+        usleep(10000);
+    }
+    if (header->magic != FEATURE_STORE_MAGIC || header->size != (uint64_t)file_stat.st_size) {
+        printf("Error: %s is not a feature store\n", name);
+        exit(1);
+    }
+    if (header->seed != seed || header->feature_size != feature_size ||
+        header->dataset_bytes != (int64_t)dataset->st_size || header->dataset_mtime != (int64_t)dataset->st_mtime) {
+        printf("Error: Feature store %s holds another split (seed %llu, %d features); remove it or use another name\n",
+               name, (unsigned long long)header->seed, header->feature_size);
+        exit(1);
+    }
+
+    int refcount = __atomic_add_fetch(&header->refcount, 1, __ATOMIC_ACQ_REL);
+    store->header = header;
+    store->name = name;
+    featureStoreSections(store);
+    printf("Feature Store: attached %s (%d training and %d test rows, %d attached)\n", name,
+           header->train_size, header->test_size, refcount);
+    return 1;
+}
+
+// Drop this process's reference. The store outlives its users for the next job on the
+// host unless remove_when_unused is set and this was the last reference.
+void featureStoreDetach(FeatureStore *store, int remove_when_unused) {
+    if (!store->header) {
+        return;
+    }
+    int refcount = __atomic_sub_fetch(&store->header->refcount, 1, __ATOMIC_ACQ_REL);
+    munmap(store->header, store->header->size);
+    if (remove_when_unused && refcount == 0) {
+        featureStoreUnlink(store->name);
+        printf("Feature Store: removed %s\n", store->name);
+    }
+    store->header = NULL;
+}
+
+// Random weight initialization (fan_out rows of fan_in weights) using Xavier or He method.
+// Weights are generated 4 at a time from one Philox block per index, so the result is
+// bit-identical for a given seed no matter how many threads run the loop.
+// fillWeights does the work; init_weights also times it.
+static void fillWeights(float *weights, int fan_in, int fan_out, uint64_t seed, WeightInit scheme) {
+    long long count = (long long)fan_in * fan_out;
+    long long num_blocks = (count + 3) / 4;
+    float xavier_limit = sqrtf(6.0f / (float)(fan_in + fan_out));
+    float he_stddev = sqrtf(2.0f / (float)fan_in);
+    const float two_pi = 6.28318530717958647692f;
+
+    #pragma omp parallel for schedule(static)
+    for (long long b = 0; b < num_blocks; b++) {
+        uint32_t r[4];
+        float values[4];
+        philoxBlock(seed, STREAM_WEIGHTS, (uint64_t)b, r);
+        if (scheme == INIT_HE) {
+            // Box-Muller: each pair of uniforms gives two independent normals
+            for (int p = 0; p < 4; p += 2) {
+                float radius = sqrtf(-2.0f * logf(philoxUniform(r[p]))) * he_stddev;
+                float angle = two_pi * philoxUniform(r[p + 1]);
+                values[p] = radius * cosf(angle);
+                values[p + 1] = radius * sinf(angle);
+            }
+        } else {
+            for (int p = 0; p < 4; p++) {
+                values[p] = (2.0f * philoxUniform(r[p]) - 1.0f) * xavier_limit;
+            }
+        }
+        long long base = b * 4;
+        for (int p = 0; p < 4 && base + p < count; p++) {
+            weights[base + p] = values[p];
+        }
+    }
+}
+
+void init_weights(float *weights, int fan_in, int fan_out, uint64_t seed, WeightInit scheme) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    fillWeights(weights, fan_in, fan_out, seed, scheme);
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Weight Initialization Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Weight Initialization", &start_energy, execution_time);
+}
+
+// Dot product of one input row with the weights in the DENSE_LANES order. Always inlined,
+// so instances with a constant size get fully specialized loops.
+static inline __attribute__((always_inline)) float denseRowDot(const float *row, const float *weights, int size) {
+    float lanes[DENSE_LANES] = {0.0f};
+    int vector_end = size - size % DENSE_LANES;
+    for (int k = 0; k < vector_end; k += DENSE_LANES) {
+        for (int l = 0; l < DENSE_LANES; l++) {
+            lanes[l] += row[k + l] * weights[k + l];
+        }
+    }
+    float sum = 0.0f;
+    for (int l = 0; l < DENSE_LANES; l++) {
+        sum += lanes[l];
+    }
+    float tail = 0.0f;
+    for (int k = vector_end; k < size; k++) {
+        tail += row[k] * weights[k];
+    }
+    return sum + tail;
+}
+
+// Dense kernel instance for a compile-time size. The size is a literal inside the parallel
+// loop, so the compiler unrolls for it (OpenMP outlines the loop before inlining).
+// Each output is summed by a single thread in a fixed order, so scores do not depend on the
+// thread count, and every instance gives the same bits as the generic kernel.
+#define DEFINE_DENSE_KERNEL(SIZE) \
+    static void denseKernel##SIZE(const float *inputs, const float *weights, float bias, float *outputs, \
+                                  int num_samples, int size) { \
+        (void)size; \
+        _Pragma("omp parallel for schedule(static)") \
+        for (int i = 0; i < num_samples; i++) { \
+            outputs[i] = bias + denseRowDot(inputs + (size_t)i * (SIZE), weights, (SIZE)); \
+        } \
+    }
+
+DEFINE_DENSE_KERNEL(256)
+DEFINE_DENSE_KERNEL(512)
+DEFINE_DENSE_KERNEL(1024)
+DEFINE_DENSE_KERNEL(4096)
+
+// Dense kernel for any size
+static void denseKernelGeneric(const float *inputs, const float *weights, float bias, float *outputs, int num_samples, int size) {
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_samples; i++) {
+        outputs[i] = bias + denseRowDot(inputs + (size_t)i * size, weights, size);
+    }
+}
+
+static const DenseKernelEntry dense_kernels[] = {
+    { 256, denseKernel256 },
+    { 512, denseKernel512 },
+    { 1024, denseKernel1024 },
+    { 4096, denseKernel4096 },
+};
+
+// Specialized dense kernel for size, or the generic one
+DenseKernel lookupDenseKernel(int size) {
+    for (size_t e = 0; e < sizeof(dense_kernels) / sizeof(dense_kernels[0]); e++) {
+        if (dense_kernels[e].size == size) {
+            return dense_kernels[e].kernel;
+        }
+    }
+    return denseKernelGeneric;
+}
+
+// Dense layer computation
+void denseLayer(float *inputs, float *weights, float *biases, float *outputs, int num_samples, int embedding_size) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    metricsStage("dense", num_samples);
+    lookupDenseKernel(embedding_size)(inputs, weights, biases[0], outputs, num_samples, embedding_size); // Only one output
+    metricAdd(METRIC_ROWS, num_samples);
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Dense Layer Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Dense Layer", &start_energy, execution_time);
+}
+
+// Score one tweet with the dense model, through the same row writer and dense kernel as
+// the batch path. The text can be any view: the dataset arena, a mapping or a caller's buffer.
+// scratch is an aligned row of feature_size floats reused across calls, or NULL to allocate one.
+float scoreTweet(StringView text, const float *weights, const float *biases, float *scratch) {
+    long long start = metrics_enabled ? nowNanoseconds() : 0;
+    float *row = scratch ? scratch : (float *)safe_aligned_malloc((size_t)feature_size * sizeof(float), "tweetRow");
+    embedRow(row, text.data, text.length, 0);
+    float output;
+    lookupDenseKernel(feature_size)(row, weights, biases[0], &output, 1, feature_size);
+    if (!scratch) {
+        free(row);
+    }
+    float score = 1.0f / (1.0f + expf(-output));
+    if (metrics_enabled) {
+        hdrRecord(&metric_histograms[METRIC_TWEET_LATENCY], nowNanoseconds() - start);
+    }
+    return score;
+}
+
+// Score each test tweet on its own, as a request would be, and report the latency
+// distribution of single tweets and of the tokenization batches, with interval snapshots
+void runLatency(const Post *testSet, int testSize, const float *weights, const float *biases) {
+    printf("Measuring per-tweet latency over %d test tweets...\n", testSize);
+    HdrHistogram tweets, batches;
+    hdrInit(&tweets);
+    hdrInit(&batches);
+    static HdrSnapshot now, before, interval;
+    memset(&before, 0, sizeof(before));
+
+    float *rows = (float *)safe_aligned_malloc((size_t)maxThreads() * TOKENIZE_BATCH * feature_size * sizeof(float), "latencyRows");
+    int num_blocks = (testSize + LATENCY_BLOCK - 1) / LATENCY_BLOCK;
+    for (int block = 0; block < num_blocks; block++) {
+        int first = block * LATENCY_BLOCK;
+        int end = first + LATENCY_BLOCK < testSize ? first + LATENCY_BLOCK : testSize;
+        // Single tweets reuse the first row of each thread's scratch matrix, so no allocation is timed
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int i = first; i < end; i++) {
+#ifdef _OPENMP
+            float *row = rows + (size_t)omp_get_thread_num() * TOKENIZE_BATCH * feature_size;
+#else
+            float *row = rows;
+#endif
+            long long start = nowNanoseconds();
+            scoreTweet(testSet[i].text, weights, biases, row);
+            hdrRecord(&tweets, nowNanoseconds() - start);
+        }
+        // The same tweets as tokenization batches into a per-thread scratch matrix
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int b = first; b < end; b += TOKENIZE_BATCH) {
+#ifdef _OPENMP
+            float *scratch = rows + (size_t)omp_get_thread_num() * TOKENIZE_BATCH * feature_size;
+#else
+            float *scratch = rows;
+#endif
+            long long start = nowNanoseconds();
+            for (int i = b; i < end && i < b + TOKENIZE_BATCH; i++) {
+                embedRow(scratch + (size_t)(i - b) * feature_size, testSet[i].text.data, testSet[i].text.length, 0);
+            }
+            hdrRecord(&batches, nowNanoseconds() - start);
+        }
+
+        hdrSnapshot(&tweets, &now);
+        hdrInterval(&now, &before, &interval);
+        char label[64];
+        snprintf(label, sizeof(label), "Tweet Latency (tweets %d-%d)", first, end - 1);
+        printLatencySummary(label, &interval);
+        before = now;
+    }
+
+    printLatencySummary("Tweet Latency", &now);
+    hdrSnapshot(&batches, &now);
+    printLatencySummary("Tokenization Batch Latency", &now);
+
+    free(rows);
+    hdrFree(&tweets);
+    hdrFree(&batches);
+}
+
+// Restore the min-heap property (by |contribution|) below slot `index`
+static inline void contributionSiftDown(Contribution *heap, int size, int index) {
+    for (;;) {
+        int smallest = index;
+        int left = 2 * index + 1, right = left + 1;
+        if (left < size && fabsf(heap[left].contribution) < fabsf(heap[smallest].contribution)) {
+            smallest = left;
+        }
+        if (right < size && fabsf(heap[right].contribution) < fabsf(heap[smallest].contribution)) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        Contribution temp = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = temp;
+        index = smallest;
+    }
+}
+
+// Dense layer that also keeps the top_k largest |weight x value| contributions of every
+// tweet in a fixed-size min-heap, filled during the same pass over the features.
+// explanations holds top_k entries per tweet, sorted by decreasing |contribution|;
+// unused entries have position -1. Only positions inside the text of posts[i] are
+// candidates, so every position maps back to a character of the tweet.
+void denseLayerExplain(const Post *posts, float *inputs, float *weights, float *biases, float *outputs,
+                       Contribution *explanations, int num_samples, int embedding_size, int top_k) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_samples; i++) {
+        const float *row = inputs + (size_t)i * embedding_size;
+        Contribution *heap = explanations + (size_t)i * top_k;
+        int heap_size = 0;
+        int text_end = posts[i].text.length < embedding_size ? posts[i].text.length : embedding_size;
+        // Same summation order as denseRowDot, so the scores match denseLayer exactly
+        float lanes[DENSE_LANES] = {0.0f};
+        float tail = 0.0f;
+        int vector_end = embedding_size - embedding_size % DENSE_LANES;
+        for (int k = 0; k < embedding_size; k++) {
+            float contribution = row[k] * weights[k];
+            if (k < vector_end) {
+                lanes[k % DENSE_LANES] += contribution;
+            } else {
+                tail += contribution;
+            }
+            if (k >= text_end) {
+                continue; // Padding after the end of the tweet
+            }
+            if (heap_size < top_k) {
+                // Heap not full yet: append and sift up
+                int child = heap_size++;
+                heap[child].contribution = contribution;
+                heap[child].position = k;
+                while (child > 0) {
+                    int parent = (child - 1) / 2;
+                    if (fabsf(heap[parent].contribution) <= fabsf(heap[child].contribution)) {
+                        break;
+                    }
+                    Contribution temp = heap[parent];
+                    heap[parent] = heap[child];
+                    heap[child] = temp;
+                    child = parent;
+                }
+            } else if (fabsf(contribution) > fabsf(heap[0].contribution)) {
+                heap[0].contribution = contribution;
+                heap[0].position = k;
+                contributionSiftDown(heap, heap_size, 0);
+            }
+        }
+        float sum = 0.0f;
+        for (int l = 0; l < DENSE_LANES; l++) {
+            sum += lanes[l];
+        }
+        outputs[i] = biases[0] + (sum + tail);
+
+        // Heap sort in place: repeatedly move the smallest to the back
+        for (int end = heap_size - 1; end > 0; end--) {
+            Contribution temp = heap[0];
+            heap[0] = heap[end];
+            heap[end] = temp;
+            contributionSiftDown(heap, end, 0);
+        }
+        for (int e = heap_size; e < top_k; e++) {
+            heap[e].contribution = 0.0f;
+            heap[e].position = -1;
+        }
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Dense Layer (Explain) Time: %.4f seconds\n", execution_time);
+}
+
+// Token span (start, length) of the word containing character `position` of text; a
+// single character span when that character is a delimiter
+void tokenSpanAt(StringView text, int position, int *start, int *length) {
+    int begin = position, end = position + 1;
+    if (isTokenChar((unsigned char)text.data[position])) {
+        while (begin > 0 && isTokenChar((unsigned char)text.data[begin - 1])) {
+            begin--;
+        }
+        while (end < text.length && isTokenChar((unsigned char)text.data[end])) {
+            end++;
+        }
+    }
+    *start = begin;
+    *length = end - begin;
+}
+
+// Apply sigmoid activation
+void sigmoidActivation(float *outputs, int size) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < size; i++) {
+        outputs[i] = 1.0f / (1.0f + expf(-outputs[i]));
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Sigmoid Activation Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Sigmoid Activation", &start_energy, execution_time);
+}
+
+// Evaluate model predictions
+float evaluate(float *outputs, int *labels, int num_samples) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    int correct = 0;
+    long long num_chunks = reduceNumChunks(num_samples);
+    double *loss_partials = (double *)safe_malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(double), "loss_partials");
+
+    // Accuracy is an integer count; the log loss is summed per fixed chunk and the chunk
+    // partials are combined pairwise, so both are identical for any thread count
+    #pragma omp parallel for schedule(static) reduction(+:correct)
+    for (long long c = 0; c < num_chunks; c++) {
+        int end = (int)((c + 1) * REDUCE_CHUNK < num_samples ? (c + 1) * REDUCE_CHUNK : num_samples);
+        double leaves[REDUCE_CHUNK / REDUCE_LEAF];
+        int num_leaves = 0;
+        for (int l = (int)(c * REDUCE_CHUNK); l < end; l += REDUCE_LEAF) {
+            double loss = 0.0;
+            for (int i = l; i < end && i < l + REDUCE_LEAF; i++) {
+                int predicted_label = outputs[i] > DECISION_THRESHOLD ? 4 : 0; // If > 0.6, predict positive (4), else negative (0)
+                if (predicted_label == labels[i]) {
+                    correct++;
+                }
+                float p = fminf(fmaxf(outputs[i], 1e-7f), 1.0f - 1e-7f);
+                loss -= labels[i] == 4 ? log((double)p) : log(1.0 - (double)p);
+            }
+            leaves[num_leaves++] = loss;
+        }
+        loss_partials[c] = pairwiseSum(leaves, num_leaves);
+    }
+    double log_loss = pairwiseSum(loss_partials, num_chunks) / num_samples;
+    free(loss_partials);
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Evaluation Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Evaluation", &start_energy, execution_time);
+    printf("Log Loss: %.6f\n", log_loss);
+
+    return (float)correct / num_samples;
+}
+
+// Extract hashed word features for every tweet: full 32-bit hashes (models mask them to
+// their table size), or with a remap, each feature's rank by training frequency
+void extractHashedFeatures(Post *dataset, int num_samples, const FeatureRemap *remap, HashedFeatures *features) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    features->num_samples = num_samples;
+    features->offsets = (long long *)safe_malloc((num_samples + 1) * sizeof(long long), "offsets");
+
+    // First pass counts the tokens of each tweet, second pass fills them in
+    uint32_t scratch[MAX_TOKENS];
+    features->offsets[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 256) private(scratch)
+    for (int i = 0; i < num_samples; i++) {
+        features->offsets[i + 1] = hashTokens(dataset[i].text, scratch, MAX_TOKENS);
+    }
+    for (int i = 0; i < num_samples; i++) {
+        features->offsets[i + 1] += features->offsets[i];
+    }
+
+    features->ids = (uint32_t *)safe_malloc((features->offsets[num_samples] + 1) * sizeof(uint32_t), "ids");
+    metricsStage("hashed features", num_samples);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < num_samples; i++) {
+        uint32_t *ids = features->ids + features->offsets[i];
+        int count = hashTokens(dataset[i].text, ids, (int)(features->offsets[i + 1] - features->offsets[i]));
+        metricAdd(METRIC_ROWS, 1);
+        if (remap) {
+            uint32_t mask = (1u << remap->hash_bits) - 1u;
+            for (int k = 0; k < count; k++) {
+                ids[k] = remap->table[ids[k] & mask];
+            }
+        }
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Hashed Feature Extraction Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Hashed Feature Extraction", &start_energy, execution_time);
+}
+
+void freeHashedFeatures(HashedFeatures *features) {
+    free(features->offsets);
+    free(features->ids);
+}
+
+// Probability of a positive label for one tweet's hashed features
+static inline __attribute__((always_inline)) float scoreHashedLinear(const HashedLinearModel *model, const uint32_t *ids,
+                                                                     int count, uint32_t mask) {
+    float sum = model->bias;
+    for (int k = 0; k < count; k++) {
+        sum += model->weights[ids[k] & mask];
+    }
+    return 1.0f / (1.0f + expf(-sum));
+}
+
+// Train a hashed logistic regression with plain SGD (in dataset order, so it is reproducible)
+void trainHashedLinearModel(HashedLinearModel *model, const HashedFeatures *features, const int *labels, int epochs, float learning_rate) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    size_t table_size = (size_t)1 << model->hash_bits;
+    uint32_t mask = (uint32_t)(table_size - 1);
+    model->weights = (float *)safe_malloc(table_size * sizeof(float), "hashedWeights");
+    memset(model->weights, 0, table_size * sizeof(float));
+    model->bias = 0.0f;
+
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        for (int i = 0; i < features->num_samples; i++) {
+            const uint32_t *ids = features->ids + features->offsets[i];
+            int count = (int)(features->offsets[i + 1] - features->offsets[i]);
+            float target = labels[i] == 4 ? 1.0f : 0.0f;
+            float gradient = scoreHashedLinear(model, ids, count, mask) - target;
+            for (int k = 0; k < count; k++) {
+                model->weights[ids[k] & mask] -= learning_rate * gradient;
+            }
+            model->bias -= learning_rate * gradient;
+        }
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Hashed Model Training Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Hashed Model Training", &start_energy, execution_time);
+}
+
+// Hashed scoring prefetches the weights of the tweet this many tweets ahead (0: off),
+// set by tunePrefetchDistance
+int hashed_prefetch_distance = 0;
+
+// Prefetch the weights one tweet will read
+static inline __attribute__((always_inline)) void prefetchHashedWeights(const HashedLinearModel *model, const HashedFeatures *features,
+                                                                        int i, uint32_t mask) {
+    for (long long k = features->offsets[i]; k < features->offsets[i + 1]; k++) {
+        __builtin_prefetch(model->weights + (features->ids[k] & mask), 0, 1);
+    }
+}
+
+// Hashed scoring instance for a compile-time table size (the mask is a constant)
+#define DEFINE_HASHED_KERNEL(BITS) \
+    static void hashedKernel##BITS(const HashedLinearModel *model, const HashedFeatures *features, float *outputs) { \
+        int distance = hashed_prefetch_distance; \
+        _Pragma("omp parallel for schedule(static)") \
+        for (int i = 0; i < features->num_samples; i++) { \
+            if (distance > 0 && i + distance < features->num_samples) { \
+                prefetchHashedWeights(model, features, i + distance, (1u << (BITS)) - 1u); \
+            } \
+            outputs[i] = scoreHashedLinear(model, features->ids + features->offsets[i], \
+                                           (int)(features->offsets[i + 1] - features->offsets[i]), (1u << (BITS)) - 1u); \
+        } \
+    }
+
+DEFINE_HASHED_KERNEL(12)
+DEFINE_HASHED_KERNEL(18)
+
+// Hashed scoring for any table size
+static void hashedKernelGeneric(const HashedLinearModel *model, const HashedFeatures *features, float *outputs) {
+    uint32_t mask = (uint32_t)(((size_t)1 << model->hash_bits) - 1);
+    int distance = hashed_prefetch_distance;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < features->num_samples; i++) {
+        if (distance > 0 && i + distance < features->num_samples) {
+            prefetchHashedWeights(model, features, i + distance, mask);
+        }
+        outputs[i] = scoreHashedLinear(model, features->ids + features->offsets[i],
+                                       (int)(features->offsets[i + 1] - features->offsets[i]), mask);
+    }
+}
+
+static const HashedKernelEntry hashed_kernels[] = {
+    { 12, hashedKernel12 },
+    { 18, hashedKernel18 },
+};
+
+// Specialized hashed scoring kernel for hash_bits, or the generic one
+HashedKernel lookupHashedKernel(int hash_bits) {
+    for (size_t e = 0; e < sizeof(hashed_kernels) / sizeof(hashed_kernels[0]); e++) {
+        if (hashed_kernels[e].hash_bits == hash_bits) {
+            return hashed_kernels[e].kernel;
+        }
+    }
+    return hashedKernelGeneric;
+}
+
+// Score every tweet with the hashed model
+void scoreHashedFeatures(const HashedLinearModel *model, const HashedFeatures *features, float *outputs) {
+    lookupHashedKernel(model->hash_bits)(model, features, outputs);
+}
+
+// Pick the prefetch distance (in tweets) that scores features fastest with this model
+int tunePrefetchDistance(const HashedLinearModel *model, const HashedFeatures *features) {
+    static const int candidates[] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+    float *outputs = (float *)safe_malloc(features->num_samples * sizeof(float), "prefetchOutputs");
+    int best = 0;
+    double best_time = 0.0;
+    for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+        hashed_prefetch_distance = candidates[c];
+        double time = 0.0;
+        for (int r = 0; r < PREFETCH_TUNE_REPEATS; r++) {
+            double start = wallSeconds();
+            scoreHashedFeatures(model, features, outputs);
+            double elapsed = wallSeconds() - start;
+            time = r == 0 || elapsed < time ? elapsed : time;
+        }
+        if (c == 0 || time < best_time) {
+            best = candidates[c];
+            best_time = time;
+        }
+    }
+    free(outputs);
+    hashed_prefetch_distance = best;
+    return best;
+}
+
+static const uint32_t *remap_counts; // qsort has no context argument
+
+// Most frequent first, ties by feature id
+int compareFeatureFrequency(const void *a, const void *b) {
+    uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+    if (remap_counts[ia] != remap_counts[ib]) {
+        return remap_counts[ia] > remap_counts[ib] ? -1 : 1;
+    }
+    return (ia > ib) - (ia < ib);
+}
+
+// Rank the features of a hash_bits table by how often they occur in the (unremapped)
+// training features, so the hottest weights end up next to each other
+void buildFeatureRemap(const HashedFeatures *features, int hash_bits, FeatureRemap *remap) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    size_t table_size = (size_t)1 << hash_bits;
+    uint32_t mask = (uint32_t)(table_size - 1);
+    uint32_t *counts = (uint32_t *)calloc(table_size, sizeof(uint32_t));
+    uint32_t *order = (uint32_t *)safe_malloc(table_size * sizeof(uint32_t), "remapOrder");
+    if (!counts) {
+        printf("Error: Memory allocation failed for remap counts.\n");
+        exit(1);
+    }
+    long long num_ids = features->offsets[features->num_samples];
+    for (long long k = 0; k < num_ids; k++) {
+        counts[features->ids[k] & mask]++;
+    }
+    for (size_t f = 0; f < table_size; f++) {
+        order[f] = (uint32_t)f;
+    }
+    remap_counts = counts;
+    qsort(order, table_size, sizeof(uint32_t), compareFeatureFrequency);
+
+    remap->hash_bits = hash_bits;
+    remap->table = (uint32_t *)safe_malloc(table_size * sizeof(uint32_t), "remapTable");
+    for (size_t rank = 0; rank < table_size; rank++) {
+        remap->table[order[rank]] = (uint32_t)rank;
+    }
+
+    // Share of training lookups served by the hottest REMAP_HOT_WEIGHTS weights
+    long long hot = 0;
+    for (size_t rank = 0; rank < table_size && rank < REMAP_HOT_WEIGHTS; rank++) {
+        hot += counts[order[rank]];
+    }
+    free(counts);
+    free(order);
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Feature Remap Time: %.4f seconds\n", execution_time);
+    printf("Feature Remap Coverage: hottest %d of %zu weights serve %.2f%% of training lookups\n",
+           REMAP_HOT_WEIGHTS < (int)table_size ? REMAP_HOT_WEIGHTS : (int)table_size, table_size,
+           num_ids > 0 ? 100.0 * hot / num_ids : 0.0);
+}
+
+// Move a trained model's weights to their remapped positions
+void remapHashedModel(HashedLinearModel *model, const FeatureRemap *remap) {
+    size_t table_size = (size_t)1 << model->hash_bits;
+    float *weights = (float *)safe_malloc(table_size * sizeof(float), "remappedWeights");
+    for (size_t f = 0; f < table_size; f++) {
+        weights[remap->table[f]] = model->weights[f];
+    }
+    free(model->weights);
+    model->weights = weights;
+}
+
+// Print one LLC miss count, or why there is none
+void printLlcMisses(const char *label, long long misses, int repeats) {
+    if (misses < 0) {
+        printf("%s LLC Misses: unavailable (no perf_event access)\n", label);
+    } else {
+        printf("%s LLC Misses: %lld per pass\n", label, misses / repeats);
+    }
+}
+
+// Score the test set with the hashed model in hash order and in frequency order, and
+// report the scoring time and LLC misses of both layouts (the scores are identical)
+void runFeatureRemap(Post *trainSet, int *trainLabels, int trainSize, Post *testSet, int testSize, int hash_bits) {
+    printf("Running frequency-ordered feature remap (2^%d weights)...\n", hash_bits);
+
+    HashedLinearModel model = { hash_bits, NULL, 0.0f };
+    HashedFeatures train_features;
+    extractHashedFeatures(trainSet, trainSize, NULL, &train_features);
+    trainHashedLinearModel(&model, &train_features, trainLabels, CASCADE_EPOCHS, CASCADE_LEARNING_RATE);
+
+    FeatureRemap remap;
+    buildFeatureRemap(&train_features, hash_bits, &remap);
+    freeHashedFeatures(&train_features);
+    HashedLinearModel remapped = { hash_bits, (float *)safe_malloc(((size_t)1 << hash_bits) * sizeof(float), "remappedModel"), model.bias };
+    memcpy(remapped.weights, model.weights, ((size_t)1 << hash_bits) * sizeof(float));
+    remapHashedModel(&remapped, &remap);
+
+    HashedFeatures hashed, ranked;
+    extractHashedFeatures(testSet, testSize, NULL, &hashed);
+    extractHashedFeatures(testSet, testSize, &remap, &ranked);
+
+    float *hashed_scores = (float *)safe_malloc(testSize * sizeof(float), "hashedScores");
+    float *ranked_scores = (float *)safe_malloc(testSize * sizeof(float), "rankedScores");
+    LlcMissCounter counter;
+    llcCounterOpen(&counter, 0);
+    double hashed_time = 0.0, ranked_time = 0.0;
+    long long hashed_misses = 0, ranked_misses = 0;
+    for (int r = 0; r < REMAP_REPEATS; r++) {
+        llcCounterStart(&counter);
+        double start = wallSeconds();
+        scoreHashedFeatures(&model, &hashed, hashed_scores);
+        hashed_time += wallSeconds() - start;
+        long long misses = llcCounterStop(&counter);
+        hashed_misses = misses < 0 || hashed_misses < 0 ? -1 : hashed_misses + misses;
+
+        llcCounterStart(&counter);
+        start = wallSeconds();
+        scoreHashedFeatures(&remapped, &ranked, ranked_scores);
+        ranked_time += wallSeconds() - start;
+        misses = llcCounterStop(&counter);
+        ranked_misses = misses < 0 || ranked_misses < 0 ? -1 : ranked_misses + misses;
+    }
+    llcCounterClose(&counter);
+
+    printf("Hash Order Scoring Time: %.4f seconds per pass\n", hashed_time / REMAP_REPEATS);
+    printf("Frequency Order Scoring Time: %.4f seconds per pass (%.2fx)\n", ranked_time / REMAP_REPEATS,
+           hashed_time / ranked_time);
+    printLlcMisses("Hash Order", hashed_misses, REMAP_REPEATS);
+    printLlcMisses("Frequency Order", ranked_misses, REMAP_REPEATS);
+    printf("Remapped Scores Identical: %s\n",
+           memcmp(hashed_scores, ranked_scores, testSize * sizeof(float)) == 0 ? "yes" : "NO");
+
+    freeHashedFeatures(&hashed);
+    freeHashedFeatures(&ranked);
+    free(hashed_scores);
+    free(ranked_scores);
+    free(remap.table);
+    free(model.weights);
+    free(remapped.weights);
+}
+
+// A chunk of hashed training features in the spill file: ids (uint32, masked to the table),
+// then the token count of each tweet (uint16), then the labels (uint8)
+typedef struct {
+    off_t offset;
+    int rows;
+    long long num_ids;
+    size_t bytes;
+} SpillChunk;
+
+// Double-buffered reads of one epoch's chunks by a background thread. Buffer b holds the
+// chunks at even or odd positions of the epoch order; state[b] is 1 while it holds a chunk
+// the trainer has not consumed yet.
+typedef struct {
+    int fd;
+    const SpillChunk *chunks;
+    const int *order;
+    int num_chunks;
+    unsigned char *buffers[2];
+    int state[2];
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} SpillReader;
+
+static void *spillReadAhead(void *arg) {
+    SpillReader *reader = (SpillReader *)arg;
+    for (int position = 0; position < reader->num_chunks; position++) {
+        int b = position & 1;
+        pthread_mutex_lock(&reader->lock);
+        while (reader->state[b]) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        pthread_mutex_unlock(&reader->lock);
+
+        const SpillChunk *chunk = &reader->chunks[reader->order[position]];
+        size_t done = 0;
+        while (done < chunk->bytes) {
+            ssize_t got = pread(reader->fd, reader->buffers[b] + done, chunk->bytes - done, chunk->offset + (off_t)done);
+            if (got <= 0) {
+                break;
+            }
+            done += (size_t)got;
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        reader->failed |= done != chunk->bytes;
+        reader->state[b] = 1;
+        metricSet(METRIC_QUEUE_DEPTH, reader->state[0] + reader->state[1]);
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    return NULL;
+}
+
+// One SGD pass over a chunk, in its stored order
+static void trainSpillChunk(HashedLinearModel *model, const unsigned char *data, int rows, long long num_ids,
+                            float learning_rate) {
+    const uint32_t *ids = (const uint32_t *)data;
+    const uint16_t *counts = (const uint16_t *)(ids + num_ids);
+    const uint8_t *labels = (const uint8_t *)(counts + rows);
+    uint32_t mask = (uint32_t)(((size_t)1 << model->hash_bits) - 1);
+    for (int i = 0; i < rows; i++) {
+        float gradient = scoreHashedLinear(model, ids, counts[i], mask) - (labels[i] == 4 ? 1.0f : 0.0f);
+        for (int k = 0; k < counts[i]; k++) {
+            model->weights[ids[k]] -= learning_rate * gradient;
+        }
+        model->bias -= learning_rate * gradient;
+        ids += counts[i];
+    }
+}
+
+// Train the hashed model for several epochs without keeping the features in memory. The
+// first epoch tokenizes the (already shuffled) training set chunk by chunk, trains on each
+// chunk and appends it to a spill file in a compact form. Later epochs visit the chunks in a
+// new order each epoch while a background thread reads the next chunk, so they cost a read
+// of the compact features instead of parsing and hashing the text again.
+void runSpilledTraining(Post *trainSet, int *trainLabels, int trainSize, Post *testSet, int *testLabels, int testSize,
+                        int epochs, int hash_bits, const char *spill_dir, uint64_t seed) {
+    printf("Running spilled hashed training (%d epochs, 2^%d weights, chunks of %d tweets)...\n", epochs, hash_bits,
+           SPILL_CHUNK_ROWS);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sentiment-spill-XXXXXX", spill_dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Error: Could not create spill file in %s\n", spill_dir);
+        exit(1);
+    }
+    unlink(path); // Removed with the last descriptor, even if the run is interrupted
+
+    size_t table_size = (size_t)1 << hash_bits;
+    uint32_t mask = (uint32_t)(table_size - 1);
+    HashedLinearModel model = { hash_bits, (float *)safe_malloc(table_size * sizeof(float), "spillWeights"), 0.0f };
+    memset(model.weights, 0, table_size * sizeof(float));
+
+    int num_chunks = (trainSize + SPILL_CHUNK_ROWS - 1) / SPILL_CHUNK_ROWS;
+    SpillChunk *chunks = (SpillChunk *)safe_malloc((num_chunks + 1) * sizeof(SpillChunk), "spillChunks");
+    long long *offsets = (long long *)safe_malloc((SPILL_CHUNK_ROWS + 1) * sizeof(long long), "spillOffsets");
+    size_t max_bytes = 0;
+    unsigned char *buffer = NULL;
+    size_t buffer_bytes = 0;
+    double tokenize_time = 0.0, write_time = 0.0;
+
+    // Epoch 1: tokenize, train and spill each chunk
+    metricsStage("spill training", (long long)trainSize * epochs);
+    double epoch_start = wallSeconds();
+    off_t file_offset = 0;
+    for (int c = 0; c < num_chunks; c++) {
+        int first = c * SPILL_CHUNK_ROWS;
+        int rows = trainSize - first < SPILL_CHUNK_ROWS ? trainSize - first : SPILL_CHUNK_ROWS;
+        double start = wallSeconds();
+        uint32_t scratch[MAX_TOKENS];
+        offsets[0] = 0;
+        #pragma omp parallel for schedule(dynamic, 256) private(scratch)
+        for (int i = 0; i < rows; i++) {
+            offsets[i + 1] = hashTokens(trainSet[first + i].text, scratch, MAX_TOKENS);
+        }
+        for (int i = 0; i < rows; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+        long long num_ids = offsets[rows];
+        size_t bytes = (size_t)num_ids * sizeof(uint32_t) + (size_t)rows * (sizeof(uint16_t) + sizeof(uint8_t));
+        if (bytes > buffer_bytes) {
+            free(buffer);
+            buffer = (unsigned char *)safe_malloc(bytes, "spillBuffer");
+            buffer_bytes = bytes;
+        }
+        uint32_t *ids = (uint32_t *)buffer;
+        uint16_t *counts = (uint16_t *)(ids + num_ids);
+        uint8_t *labels = (uint8_t *)(counts + rows);
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < rows; i++) {
+            uint32_t *row = ids + offsets[i];
+            int count = hashTokens(trainSet[first + i].text, row, (int)(offsets[i + 1] - offsets[i]));
+            for (int k = 0; k < count; k++) {
+                row[k] &= mask;
+            }
+            counts[i] = (uint16_t)count;
+            labels[i] = (uint8_t)trainLabels[first + i];
+        }
+        tokenize_time += wallSeconds() - start;
+
+        trainSpillChunk(&model, buffer, rows, num_ids, CASCADE_LEARNING_RATE);
+        metricAdd(METRIC_ROWS, rows);
+        metricRecordSeconds(METRIC_BATCH_LATENCY, wallSeconds() - start);
+
+        start = wallSeconds();
+        size_t done = 0;
+        while (done < bytes) {
+            ssize_t written = pwrite(fd, buffer + done, bytes - done, file_offset + (off_t)done);
+            if (written <= 0) {
+                printf("Error: Could not write spill file in %s\n", spill_dir);
+                exit(1);
+            }
+            done += (size_t)written;
+        }
+        write_time += wallSeconds() - start;
+        chunks[c].offset = file_offset;
+        chunks[c].rows = rows;
+        chunks[c].num_ids = num_ids;
+        chunks[c].bytes = bytes;
+        file_offset += (off_t)bytes;
+        max_bytes = bytes > max_bytes ? bytes : max_bytes;
+    }
+    free(buffer);
+    free(offsets);
+    double first_epoch = wallSeconds() - epoch_start;
+    printf("Epoch 1 Time: %.4f seconds (tokenize %.4f, write %.4f; %.1f MB spilled)\n", first_epoch, tokenize_time,
+           write_time, file_offset / 1e6);
+
+    // Later epochs: read the chunks back in a fresh order, one chunk ahead of training
+    SpillReader reader;
+    reader.fd = fd;
+    reader.chunks = chunks;
+    reader.num_chunks = num_chunks;
+    reader.buffers[0] = (unsigned char *)safe_malloc(max_bytes + 1, "spillReadBuffer");
+    reader.buffers[1] = (unsigned char *)safe_malloc(max_bytes + 1, "spillReadBuffer");
+    pthread_mutex_init(&reader.lock, NULL);
+    pthread_cond_init(&reader.changed, NULL);
+    int *order = (int *)safe_malloc((num_chunks + 1) * sizeof(int), "spillOrder");
+    reader.order = order;
+    double later_time = 0.0, wait_time = 0.0;
+    for (int epoch = 1; epoch < epochs; epoch++) {
+        for (int c = 0; c < num_chunks; c++) {
+            order[c] = c;
+        }
+        // Fisher-Yates over chunks, keyed by the epoch so each epoch has its own order
+        for (int c = num_chunks - 1; c > 0; c--) {
+            uint32_t r[4];
+            philoxBlock(seed, STREAM_SPILL, ((uint64_t)epoch << 32) | (uint64_t)c, r);
+            int j = (int)(((uint64_t)r[0] * (uint64_t)(c + 1)) >> 32);
+            int temp = order[c];
+            order[c] = order[j];
+            order[j] = temp;
+        }
+
+        epoch_start = wallSeconds();
+        reader.state[0] = reader.state[1] = 0;
+        reader.failed = 0;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, spillReadAhead, &reader) != 0) {
+            printf("Error: Could not start the spill reader thread\n");
+            exit(1);
+        }
+        for (int position = 0; position < num_chunks; position++) {
+            int b = position & 1;
+            double start = wallSeconds();
+            pthread_mutex_lock(&reader.lock);
+            while (!reader.state[b]) {
+                pthread_cond_wait(&reader.changed, &reader.lock);
+            }
+            int failed = reader.failed;
+            pthread_mutex_unlock(&reader.lock);
+            wait_time += wallSeconds() - start;
+            if (failed) {
+                printf("Error: Could not read spill file in %s\n", spill_dir);
+                exit(1);
+            }
+
+            const SpillChunk *chunk = &chunks[order[position]];
+            start = wallSeconds();
+            trainSpillChunk(&model, reader.buffers[b], chunk->rows, chunk->num_ids, CASCADE_LEARNING_RATE);
+            metricAdd(METRIC_ROWS, chunk->rows);
+            metricRecordSeconds(METRIC_BATCH_LATENCY, wallSeconds() - start);
+
+            pthread_mutex_lock(&reader.lock);
+            reader.state[b] = 0;
+            metricSet(METRIC_QUEUE_DEPTH, reader.state[0] + reader.state[1]);
+            pthread_cond_broadcast(&reader.changed);
+            pthread_mutex_unlock(&reader.lock);
+        }
+        pthread_join(thread, NULL);
+        later_time += wallSeconds() - epoch_start;
+    }
+    if (epochs > 1) {
+        printf("Later Epoch Time: %.4f seconds per epoch (%.4f waiting for reads; re-tokenizing would add %.4f)\n",
+               later_time / (epochs - 1), wait_time / (epochs - 1), tokenize_time);
+    }
+
+    HashedFeatures test_features;
+    extractHashedFeatures(testSet, testSize, NULL, &test_features);
+    float *scores = (float *)safe_malloc(testSize * sizeof(float), "spillScores");
+    scoreHashedFeatures(&model, &test_features, scores);
+    int correct = 0;
+    for (int i = 0; i < testSize; i++) {
+        correct += ((scores[i] > DECISION_THRESHOLD ? 4 : 0) == testLabels[i]);
+    }
+    printf("Spilled Model Accuracy: %.2f%%\n", 100.0 * correct / testSize);
+
+    pthread_mutex_destroy(&reader.lock);
+    pthread_cond_destroy(&reader.changed);
+    freeHashedFeatures(&test_features);
+    free(scores);
+    free(order);
+    free(reader.buffers[0]);
+    free(reader.buffers[1]);
+    free(chunks);
+    free(model.weights);
+    close(fd);
+}
+
+// One tweet's hashed dot product (without bias), as used by the gather benchmark
+typedef float (*HashedDot)(const float *weights, const uint32_t *ids, int count, uint32_t mask);
+
+static float hashedDotScalar(const float *weights, const uint32_t *ids, int count, uint32_t mask) {
+    float sum = 0.0f;
+    for (int k = 0; k < count; k++) {
+        sum += weights[ids[k] & mask];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// 8 weights per AVX2 gather; the tail is a masked gather
+__attribute__((target("avx2"))) static float hashedDotAvx2(const float *weights, const uint32_t *ids, int count, uint32_t mask) {
+    __m256i vmask = _mm256_set1_epi32((int)mask);
+    __m256 acc = _mm256_setzero_ps();
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256i idx = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(ids + k)), vmask);
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(weights, idx, 4));
+    }
+    if (k < count) {
+        __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - k), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i idx = _mm256_and_si256(_mm256_maskload_epi32((const int *)(ids + k), lanes), vmask);
+        acc = _mm256_add_ps(acc, _mm256_mask_i32gather_ps(_mm256_setzero_ps(), weights, idx, _mm256_castsi256_ps(lanes), 4));
+    }
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+    return _mm_cvtss_f32(sum4);
+}
+
+// 16 weights per AVX-512 gather; the tail is a masked gather
+__attribute__((target("avx512f"))) static float hashedDotAvx512(const float *weights, const uint32_t *ids, int count, uint32_t mask) {
+    __m512i vmask = _mm512_set1_epi32((int)mask);
+    __m512 acc = _mm512_setzero_ps();
+    for (int k = 0; k < count; k += 16) {
+        __mmask16 lanes = count - k >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (count - k)) - 1u);
+        __m512i idx = _mm512_and_si512(_mm512_maskz_loadu_epi32(lanes, ids + k), vmask);
+        acc = _mm512_add_ps(acc, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), lanes, idx, weights, 4));
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+#endif
+
+// Score every tweet with one dot product variant, prefetching hashed_prefetch_distance ahead
+void scoreHashedWithDot(const HashedLinearModel *model, const HashedFeatures *features, float *outputs, HashedDot dot) {
+    uint32_t mask = (uint32_t)(((size_t)1 << model->hash_bits) - 1);
+    int distance = hashed_prefetch_distance;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < features->num_samples; i++) {
+        if (distance > 0 && i + distance < features->num_samples) {
+            prefetchHashedWeights(model, features, i + distance, mask);
+        }
+        float sum = model->bias + dot(model->weights, features->ids + features->offsets[i],
+                                      (int)(features->offsets[i + 1] - features->offsets[i]), mask);
+        outputs[i] = 1.0f / (1.0f + expf(-sum));
+    }
+}
+
+// Benchmark sparse scoring on synthetic tweets for growing weight tables: scalar loads with
+// and without prefetching, and AVX2/AVX-512 gathers (with prefetching) where the CPU has them
+void benchmarkGather(uint64_t seed) {
+    static const int table_bits[] = { 12, 18, 22, 24 };
+    const int num_samples = 1 << 20;
+
+    // 8..23 ids per tweet; word ranks are log-uniform (roughly Zipf) and hashed over the table
+    HashedFeatures features;
+    features.num_samples = num_samples;
+    features.offsets = (long long *)safe_malloc((num_samples + 1) * sizeof(long long), "gatherOffsets");
+    features.offsets[0] = 0;
+    for (int i = 0; i < num_samples; i++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_BENCH, (uint64_t)i, r);
+        features.offsets[i + 1] = features.offsets[i] + 8 + (r[0] & 15);
+    }
+    long long num_ids = features.offsets[num_samples];
+    features.ids = (uint32_t *)safe_malloc(num_ids * sizeof(uint32_t), "gatherIds");
+    #pragma omp parallel for schedule(static)
+    for (long long k = 0; k < num_ids; k++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_BENCH, (uint64_t)(num_samples + k), r);
+        uint32_t rank = (uint32_t)expf(philoxUniform(r[0]) * logf((float)(1u << 24)));
+        features.ids[k] = rank * 2654435761u;
+    }
+
+    const char *names[4] = { "scalar", "scalar+prefetch", "avx2 gather", "avx512 gather" };
+    HashedDot dots[4] = { hashedDotScalar, hashedDotScalar, NULL, NULL };
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        dots[2] = hashedDotAvx2;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        dots[3] = hashedDotAvx512;
+    }
+#endif
+
+    float *reference = (float *)safe_malloc(num_samples * sizeof(float), "gatherReference");
+    float *outputs = (float *)safe_malloc(num_samples * sizeof(float), "gatherOutputs");
+    printf("Gather benchmark: %d tweets, %lld lookups (%d repeats, %d threads)\n", num_samples, num_ids,
+           GATHER_REPEATS, maxThreads());
+    printf("%-8s %-16s %10s %14s %12s %12s\n", "table", "kernel", "distance", "time (s)", "ns/lookup", "max diff");
+    for (size_t t = 0; t < sizeof(table_bits) / sizeof(table_bits[0]); t++) {
+        HashedLinearModel model = { table_bits[t], NULL, 0.0f };
+        size_t table_size = (size_t)1 << model.hash_bits;
+        model.weights = (float *)safe_malloc(table_size * sizeof(float), "gatherTable");
+        for (size_t k = 0; k < table_size; k++) {
+            uint32_t r[4];
+            philoxBlock(seed, STREAM_WEIGHTS, (uint64_t)k, r);
+            model.weights[k] = philoxUniform(r[0]) - 0.5f;
+        }
+        hashed_prefetch_distance = 0;
+        scoreHashedWithDot(&model, &features, reference, hashedDotScalar);
+        int tuned = tunePrefetchDistance(&model, &features);
+
+        for (int v = 0; v < 4; v++) {
+            if (!dots[v]) {
+                printf("2^%-6d %-16s %10s %14s\n", model.hash_bits, names[v], "-", "unsupported");
+                continue;
+            }
+            hashed_prefetch_distance = v == 0 ? 0 : tuned;
+            double time = 0.0;
+            for (int r = 0; r < GATHER_REPEATS; r++) {
+                double start = wallSeconds();
+                scoreHashedWithDot(&model, &features, outputs, dots[v]);
+                time += wallSeconds() - start;
+            }
+            float max_diff = 0.0f;
+            for (int i = 0; i < num_samples; i++) {
+                float diff = fabsf(outputs[i] - reference[i]);
+                max_diff = diff > max_diff ? diff : max_diff;
+            }
+            printf("2^%-6d %-16s %10d %14.5f %12.3f %12.3g\n", model.hash_bits, names[v], hashed_prefetch_distance,
+                   time / GATHER_REPEATS, 1e9 * time / GATHER_REPEATS / num_ids, max_diff);
+        }
+        free(model.weights);
+    }
+    hashed_prefetch_distance = 0;
+
+    freeHashedFeatures(&features);
+    free(reference);
+    free(outputs);
+}
+
+// Correct predictions of the cascade with a given band half width; escalated receives the
+// number of tweets handed to the expensive model
+static int cascadeCorrect(const float *cheap_scores, const float *full_scores, const int *labels, int num_samples,
+                          float band, int *escalated) {
+    int correct = 0, count = 0;
+    for (int i = 0; i < num_samples; i++) {
+        int escalate = fabsf(cheap_scores[i] - DECISION_THRESHOLD) < band;
+        float score = escalate ? full_scores[i] : cheap_scores[i];
+        correct += ((score > DECISION_THRESHOLD ? 4 : 0) == labels[i]);
+        count += escalate;
+    }
+    *escalated = count;
+    return correct;
+}
+
+// Tune the half width of the uncertainty band around DECISION_THRESHOLD: the narrowest band
+// whose cascade accuracy is within max_accuracy_loss of the expensive model alone
+float tuneCascadeBand(const float *cheap_scores, const float *full_scores, const int *labels, int num_samples, float max_accuracy_loss) {
+    int escalated;
+    int full_correct = cascadeCorrect(cheap_scores, full_scores, labels, num_samples, 2.0f, &escalated);
+    for (int step = 0; step <= 100; step++) {
+        float band = 0.01f * (float)step;
+        int correct = cascadeCorrect(cheap_scores, full_scores, labels, num_samples, band, &escalated);
+        if ((float)(full_correct - correct) / num_samples <= max_accuracy_loss) {
+            return band;
+        }
+    }
+    return 1.0f; // Escalate everything
+}
+
+// Logistic regression on the token matrix with SGD, starting from the given dense row, in
+// the same sequential order as trainHashedLinearModel
+void trainDenseModel(float *weights, float *bias, const float *token_ids, const int *labels, int num_samples,
+                     int embedding_size, int epochs, float learning_rate) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        for (int i = 0; i < num_samples; i++) {
+            const float *row = token_ids + (size_t)i * embedding_size;
+            float target = labels[i] == 4 ? 1.0f : 0.0f;
+            float gradient = 1.0f / (1.0f + expf(-(*bias + denseRowDot(row, weights, embedding_size)))) - target;
+            for (int k = 0; k < embedding_size; k++) {
+                weights[k] -= learning_rate * gradient * row[k];
+            }
+            *bias -= learning_rate * gradient;
+        }
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    printf("Dense Model Training Time: %.4f seconds\n", end_time - start_time);
+}
+
+// Two-stage cascade over the test set: the cheap hashed model scores every tweet and only
+// tweets in the uncertainty band are tokenized and scored by the dense layer. Both stages
+// are trained on the training split, so the expensive stage is a real second opinion
+// rather than the untrained dense row of the main pipeline.
+void runCascade(Post *trainSet, int *trainLabels, const float *trainTokenIds, int trainSize,
+                Post *testSet, int *testLabels, int testSize, const float *weights, const float *biases,
+                double full_test_time, float max_accuracy_loss, float fixed_band, int hash_bits) {
+    if (fixed_band >= 0.0f) {
+        printf("Running cascade (fixed band +/-%.2f)...\n", fixed_band);
+    } else {
+        printf("Running cascade (target accuracy loss %.2f%%)...\n", max_accuracy_loss * 100);
+    }
+
+    // Both models are trained for a 0.5 boundary; adding logit(DECISION_THRESHOLD) to the
+    // bias moves that boundary to DECISION_THRESHOLD, which the band and the accuracy use
+    float threshold_logit = logf(DECISION_THRESHOLD / (1.0f - DECISION_THRESHOLD));
+
+    // Train the first stage and tune the band on the training split
+    HashedLinearModel cheap = { hash_bits, NULL, 0.0f };
+    HashedFeatures train_features;
+    extractHashedFeatures(trainSet, trainSize, NULL, &train_features);
+    trainHashedLinearModel(&cheap, &train_features, trainLabels, CASCADE_EPOCHS, CASCADE_LEARNING_RATE);
+    cheap.bias += threshold_logit;
+    printf("Prefetch Distance: %d tweets\n", tunePrefetchDistance(&cheap, &train_features));
+    float *train_cheap = (float *)safe_malloc(trainSize * sizeof(float), "train_cheap");
+    scoreHashedFeatures(&cheap, &train_features, train_cheap);
+
+    // Second stage: the dense model, trained from the pipeline's initial weights
+    float *full_weights = (float *)safe_aligned_malloc((size_t)feature_size * sizeof(float), "cascadeWeights");
+    memcpy(full_weights, weights, (size_t)feature_size * sizeof(float));
+    float full_bias = biases[0];
+    trainDenseModel(full_weights, &full_bias, trainTokenIds, trainLabels, trainSize, feature_size, CASCADE_EPOCHS,
+                    CASCADE_DENSE_LEARNING_RATE);
+    full_bias += threshold_logit;
+    float *train_full = (float *)safe_malloc(trainSize * sizeof(float), "train_full");
+    denseLayer((float *)trainTokenIds, full_weights, &full_bias, train_full, trainSize, feature_size);
+    sigmoidActivation(train_full, trainSize);
+
+    float band = fixed_band >= 0.0f ? fixed_band
+                                    : tuneCascadeBand(train_cheap, train_full, trainLabels, trainSize, max_accuracy_loss);
+    int disagree = 0;
+    for (int i = 0; i < trainSize; i++) {
+        disagree += (train_cheap[i] > DECISION_THRESHOLD) != (train_full[i] > DECISION_THRESHOLD);
+    }
+    printf("Cascade Training Accuracy: cheap %.2f%%, full %.2f%%, disagree on %.2f%% of tweets\n",
+           evaluate(train_cheap, trainLabels, trainSize) * 100, evaluate(train_full, trainLabels, trainSize) * 100,
+           100.0 * disagree / trainSize);
+    // The trade-off on the training split, also when the tuned band turns out empty
+    static const float sweep[] = { 0.05f, 0.1f, 0.2f, 0.4f };
+    for (size_t b = 0; b < sizeof(sweep) / sizeof(sweep[0]); b++) {
+        int escalated;
+        int correct = cascadeCorrect(train_cheap, train_full, trainLabels, trainSize, sweep[b], &escalated);
+        printf("Cascade Band +/-%.2f: %.2f%% escalated, training accuracy %.2f%%\n", sweep[b],
+               100.0 * escalated / trainSize, 100.0 * correct / trainSize);
+    }
+    free(train_cheap);
+    free(train_full);
+
+    // Lay the weights out by training frequency; test features are remapped as they are extracted
+    FeatureRemap remap;
+    buildFeatureRemap(&train_features, hash_bits, &remap);
+    remapHashedModel(&cheap, &remap);
+    freeHashedFeatures(&train_features);
+
+    // Stage 1: cheap scores for every test tweet
+    double start_time = wallSeconds();
+    HashedFeatures test_features;
+    extractHashedFeatures(testSet, testSize, &remap, &test_features);
+    float *scores = (float *)safe_malloc(testSize * sizeof(float), "cascadeScores");
+    scoreHashedFeatures(&cheap, &test_features, scores);
+    freeHashedFeatures(&test_features);
+
+    // Stage 2: gather the uncertain tweets and run the expensive model on them only
+    int *escalated = (int *)safe_malloc(testSize * sizeof(int), "escalated");
+    int num_escalated = 0;
+    for (int i = 0; i < testSize; i++) {
+        if (fabsf(scores[i] - DECISION_THRESHOLD) < band) {
+            escalated[num_escalated++] = i;
+        }
+    }
+    if (num_escalated > 0) {
+        Post *posts = (Post *)safe_malloc(num_escalated * sizeof(Post), "escalatedPosts");
+        for (int e = 0; e < num_escalated; e++) {
+            posts[e] = testSet[escalated[e]];
+        }
+        float *token_ids = (float *)safe_aligned_malloc((size_t)num_escalated * feature_size * sizeof(float), "escalatedTokenIds");
+        float *outputs = (float *)safe_malloc(num_escalated * sizeof(float), "escalatedOutputs");
+        tokenizeAndEmbed(posts, token_ids, num_escalated, NULL);
+        denseLayer(token_ids, full_weights, &full_bias, outputs, num_escalated, feature_size);
+        sigmoidActivation(outputs, num_escalated);
+        for (int e = 0; e < num_escalated; e++) {
+            scores[escalated[e]] = outputs[e];
+        }
+        free(posts);
+        free(token_ids);
+        free(outputs);
+    }
+    double cascade_time = wallSeconds() - start_time;
+
+    float cascade_accuracy = evaluate(scores, testLabels, testSize);
+    if (band == 0.0f && fixed_band < 0.0f) {
+        printf("Cascade Band: empty (the cheap model alone is within the target loss of the full model)\n");
+    } else {
+        printf("Cascade Band: (%.2f, %.2f)\n", DECISION_THRESHOLD - band, DECISION_THRESHOLD + band);
+    }
+    printf("Cascade Escalated: %d of %d tweets (%.2f%%)\n", num_escalated, testSize, 100.0 * num_escalated / testSize);
+    printf("Cascade Accuracy: %.2f%%\n", cascade_accuracy * 100);
+    printf("Cascade Time: %.4f seconds (full model %.4f seconds, %.2fx throughput)\n",
+           cascade_time, full_test_time, full_test_time / cascade_time);
+
+    free(escalated);
+    free(scores);
+    free(cheap.weights);
+    free(full_weights);
+    free(remap.table);
+}
+
+// Ensemble layer: num_models stacked weight rows score the same inputs, so the scores are a
+// small GEMM (outputs[i * num_models + m] = biases[m] + inputs[i] . weights[m]). Each input
+// row is loaded once per tile of models instead of once per model. Every dot product is
+// summed in the denseRowDot order, so each model's scores match denseLayer bit for bit.
+void ensembleLayer(const float *inputs, const float *weights, const float *biases, float *outputs,
+                   int num_samples, int embedding_size, int num_models) {
+    double start_time = wallSeconds(); // Start time measurement
+    EnergySample start_energy = energySample();
+
+    int num_row_tiles = (num_samples + ENSEMBLE_TILE - 1) / ENSEMBLE_TILE;
+    int vector_end = embedding_size - embedding_size % ENSEMBLE_LANES;
+    int streaming = useStreamingStores(outputs, (size_t)num_samples * num_models * sizeof(float),
+                                       (num_models * sizeof(float)) % CACHE_LINE == 0);
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static) nowait
+        for (int tile = 0; tile < num_row_tiles; tile++) {
+            int i0 = tile * ENSEMBLE_TILE;
+            int rows = num_samples - i0 < ENSEMBLE_TILE ? num_samples - i0 : ENSEMBLE_TILE;
+            const float *x[ENSEMBLE_TILE];
+            for (int r = 0; r < ENSEMBLE_TILE; r++) {
+                // Short tiles repeat their last row; the extra results are not stored
+                x[r] = inputs + (size_t)(i0 + (r < rows ? r : rows - 1)) * embedding_size;
+            }
+            for (int m0 = 0; m0 < num_models; m0 += ENSEMBLE_TILE) {
+                int cols = num_models - m0 < ENSEMBLE_TILE ? num_models - m0 : ENSEMBLE_TILE;
+                const float *w[ENSEMBLE_TILE];
+                for (int c = 0; c < ENSEMBLE_TILE; c++) {
+                    w[c] = weights + (size_t)(m0 + (c < cols ? c : cols - 1)) * embedding_size;
+                }
+                // Each (tweet, model) pair keeps ENSEMBLE_LANES partial sums so the k loop
+                // vectorizes without reassociating floating point adds
+                float acc[ENSEMBLE_TILE][ENSEMBLE_TILE][ENSEMBLE_LANES] = {{{0.0f}}};
+                for (int k = 0; k < vector_end; k += ENSEMBLE_LANES) {
+                    for (int r = 0; r < ENSEMBLE_TILE; r++) {
+                        for (int c = 0; c < ENSEMBLE_TILE; c++) {
+                            for (int l = 0; l < ENSEMBLE_LANES; l++) {
+                                acc[r][c][l] += x[r][k + l] * w[c][k + l];
+                            }
+                        }
+                    }
+                }
+                for (int r = 0; r < rows; r++) {
+                    for (int c = 0; c < cols; c++) {
+                        float sum = 0.0f;
+                        for (int l = 0; l < ENSEMBLE_LANES; l++) {
+                            sum += acc[r][c][l];
+                        }
+                        float tail = 0.0f;
+                        for (int k = vector_end; k < embedding_size; k++) {
+                            tail += x[r][k] * w[c][k];
+                        }
+                        storeFloat(outputs + (size_t)(i0 + r) * num_models + m0 + c, biases[m0 + c] + (sum + tail),
+                                   streaming);
+                    }
+                }
+            }
+        }
+        streamingStoreFence(streaming);
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Ensemble Layer Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Ensemble Layer", &start_energy, execution_time);
+}
+
+// Score the shared test features with num_models models, report per-model, averaged and
+// voted accuracy, and optionally write every score to a CSV file
+void runEnsemble(const float *token_ids, const int *labels, int num_samples, const float *weights,
+                 const float *biases, int num_models, const char *output_path) {
+    printf("Running ensemble of %d models on shared features...\n", num_models);
+
+    float *scores = (float *)safe_aligned_malloc((size_t)num_samples * num_models * sizeof(float), "ensembleScores");
+    double gemm_start = wallSeconds();
+    ensembleLayer(token_ids, weights, biases, scores, num_samples, feature_size, num_models);
+    sigmoidActivation(scores, num_samples * num_models);
+    double gemm_time = wallSeconds() - gemm_start;
+
+    // Baseline: one dense kernel pass per model over the same features, timed as a whole.
+    // Model 0 is kept to check that the GEMM gives the same scores as the dense layer.
+    float *single = (float *)safe_malloc(2 * (size_t)num_samples * sizeof(float), "singleScores");
+    DenseKernel kernel = lookupDenseKernel(feature_size);
+    double separate_start = wallSeconds();
+    for (int m = 0; m < num_models; m++) {
+        kernel(token_ids, weights + (size_t)m * feature_size, biases[m], single + (m == 0 ? 0 : num_samples),
+               num_samples, feature_size);
+    }
+    double separate_time = wallSeconds() - separate_start;
+    // Bit-identical as built with the Usage Guide flags; with FMA enabled (-march) the compiler
+    // may fuse the two loops differently, so the largest difference is printed as well
+    int identical = 1;
+    float max_difference = 0.0f;
+    for (int i = 0; i < num_samples; i++) {
+        float score = 1.0f / (1.0f + expf(-single[i]));
+        identical &= memcmp(&score, &scores[(size_t)i * num_models], sizeof(float)) == 0;
+        max_difference = fmaxf(max_difference, fabsf(score - scores[(size_t)i * num_models]));
+    }
+    free(single);
+
+    int *model_correct = (int *)calloc(num_models, sizeof(int));
+    int mean_correct = 0, vote_correct = 0;
+    FILE *out = NULL;
+    if (output_path) {
+        out = fopen(output_path, "w");
+        if (!out) {
+            printf("Error: Could not open file %s\n", output_path);
+            exit(1);
+        }
+        fprintf(out, "row,label");
+        for (int m = 0; m < num_models; m++) {
+            fprintf(out, ",model_%d", m);
+        }
+        fprintf(out, ",mean,vote\n");
+    }
+    for (int i = 0; i < num_samples; i++) {
+        const float *row = scores + (size_t)i * num_models;
+        float mean = 0.0f;
+        int positive_votes = 0;
+        for (int m = 0; m < num_models; m++) {
+            int predicted_label = row[m] > DECISION_THRESHOLD ? 4 : 0;
+            model_correct[m] += (predicted_label == labels[i]);
+            positive_votes += (predicted_label == 4);
+            mean += row[m];
+        }
+        mean /= (float)num_models;
+        int mean_label = mean > DECISION_THRESHOLD ? 4 : 0;
+        // Majority vote; ties fall back to the averaged score
+        int vote_label = 2 * positive_votes > num_models ? 4 : (2 * positive_votes < num_models ? 0 : mean_label);
+        mean_correct += (mean_label == labels[i]);
+        vote_correct += (vote_label == labels[i]);
+        if (out) {
+            fprintf(out, "%d,%d", i, labels[i]);
+            for (int m = 0; m < num_models; m++) {
+                fprintf(out, ",%.6f", row[m]);
+            }
+            fprintf(out, ",%.6f,%d\n", mean, vote_label);
+        }
+    }
+    if (out) {
+        fclose(out);
+        printf("Ensemble scores written to %s\n", output_path);
+    }
+
+    for (int m = 0; m < num_models; m++) {
+        printf("Model %d Accuracy: %.2f%%\n", m, 100.0 * model_correct[m] / num_samples);
+    }
+    printf("Ensemble Averaged Accuracy: %.2f%%\n", 100.0 * mean_correct / num_samples);
+    printf("Ensemble Voted Accuracy: %.2f%%\n", 100.0 * vote_correct / num_samples);
+    if (identical) {
+        printf("Ensemble Model 0 Matches Dense Layer: yes (bit-identical)\n");
+    } else {
+        printf("Ensemble Model 0 Matches Dense Layer: NO (max score difference %.2e)\n", max_difference);
+    }
+    printf("Ensemble Time: %.4f seconds (%d separate dense layers %.4f seconds)\n", gemm_time, num_models, separate_time);
+
+    free(model_correct);
+    free(scores);
+}
+
+// Re-score the test set with explanations and report the top contributions of
+// misclassified tweets, mapped back to the token they came from
+void runExplain(Post *testSet, float *token_ids, int *labels, int num_samples, float *weights, float *biases,
+                int top_k, const char *output_path) {
+    printf("Running explain mode (top %d contributions)...\n", top_k);
+
+    float *outputs = (float *)safe_malloc(num_samples * sizeof(float), "explainOutputs");
+    Contribution *explanations = (Contribution *)safe_malloc((size_t)num_samples * top_k * sizeof(Contribution), "explanations");
+
+    // Overhead against the plain dense layer on the same inputs
+    double plain_start = wallSeconds();
+    denseLayer(token_ids, weights, biases, outputs, num_samples, feature_size);
+    double plain_time = wallSeconds() - plain_start;
+    double explain_start = wallSeconds();
+    denseLayerExplain(testSet, token_ids, weights, biases, outputs, explanations, num_samples, feature_size, top_k);
+    double explain_time = wallSeconds() - explain_start;
+    sigmoidActivation(outputs, num_samples);
+
+    FILE *out = NULL;
+    if (output_path) {
+        out = fopen(output_path, "w");
+        if (!out) {
+            printf("Error: Could not open file %s\n", output_path);
+            exit(1);
+        }
+        fprintf(out, "row,label,score,rank,position,contribution,span_start,span_length,token\n");
+    }
+    int misclassified = 0, printed = 0;
+    for (int i = 0; i < num_samples; i++) {
+        int predicted_label = outputs[i] > DECISION_THRESHOLD ? 4 : 0;
+        if (predicted_label == labels[i]) {
+            continue;
+        }
+        misclassified++;
+        int show = printed < 5;
+        if (show) {
+            printf("Tweet %d (label %d, score %.4f): %.*s\n", i, labels[i], outputs[i], testSet[i].text.length,
+                   testSet[i].text.data);
+            printed++;
+        }
+        for (int r = 0; r < top_k; r++) {
+            const Contribution *c = &explanations[(size_t)i * top_k + r];
+            if (c->position < 0) {
+                break;
+            }
+            int start, length;
+            tokenSpanAt(testSet[i].text, c->position, &start, &length);
+            if (show) {
+                printf("  %+.5f at %d  \"%.*s\"\n", c->contribution, c->position, length, testSet[i].text.data + start);
+            }
+            if (out) {
+                fprintf(out, "%d,%d,%.6f,%d,%d,%.6f,%d,%d,\"", i, labels[i], outputs[i], r, c->position,
+                        c->contribution, start, length);
+                for (int j = start; j < start + length; j++) {
+                    fputc(testSet[i].text.data[j], out);
+                    if (testSet[i].text.data[j] == '"') {
+                        fputc('"', out); // CSV escape
+                    }
+                }
+                fprintf(out, "\"\n");
+            }
+        }
+    }
+    if (out) {
+        fclose(out);
+        printf("Explanations written to %s\n", output_path);
+    }
+    printf("Misclassified Tweets Explained: %d of %d\n", misclassified, num_samples);
+    printf("Explain Overhead: %.2fx (%.4f vs %.4f seconds)\n", explain_time / plain_time, explain_time, plain_time);
+
+    free(outputs);
+    free(explanations);
+}
+
+// Ranking order for top-K selection: higher key first, lower index on ties (so the result
+// does not depend on how the scores were split between threads)
+static inline int scoredIndexBefore(ScoredIndex a, ScoredIndex b) {
+    return a.key > b.key || (a.key == b.key && a.index < b.index);
+}
+
+// Restore the heap property below slot `index` of a heap whose root is the entry
+// that ranks last
+static inline void scoredIndexSiftDown(ScoredIndex *heap, int size, int index) {
+    for (;;) {
+        int last = index;
+        int left = 2 * index + 1, right = left + 1;
+        if (left < size && scoredIndexBefore(heap[last], heap[left])) {
+            last = left;
+        }
+        if (right < size && scoredIndexBefore(heap[last], heap[right])) {
+            last = right;
+        }
+        if (last == index) {
+            return;
+        }
+        ScoredIndex temp = heap[index];
+        heap[index] = heap[last];
+        heap[last] = temp;
+        index = last;
+    }
+}
+
+// Offer a candidate to a bounded heap of capacity k; returns the new heap size
+static inline int scoredIndexOffer(ScoredIndex *heap, int size, int k, ScoredIndex candidate) {
+    if (size < k) {
+        int child = size++;
+        heap[child] = candidate;
+        while (child > 0) {
+            int parent = (child - 1) / 2;
+            if (!scoredIndexBefore(heap[parent], heap[child])) {
+                break;
+            }
+            ScoredIndex temp = heap[parent];
+            heap[parent] = heap[child];
+            heap[child] = temp;
+            child = parent;
+        }
+    } else if (scoredIndexBefore(candidate, heap[0])) {
+        heap[0] = candidate;
+        scoredIndexSiftDown(heap, size, 0);
+    }
+    return size;
+}
+
+// Select the k best tweets by `mode` from sigmoid scores in O(n log k): every thread keeps
+// a bounded heap over its share of the scores and the per-thread heaps are merged at the
+// end. Writes up to k entries to selected, best first, and returns how many were written.
+int topKSelect(const float *scores, int num_samples, int k, TopKMode mode, ScoredIndex *selected) {
+    int num_threads = maxThreads();
+    ScoredIndex *heaps = (ScoredIndex *)safe_malloc((size_t)num_threads * k * sizeof(ScoredIndex), "topKHeaps");
+    int *heap_sizes = (int *)calloc(num_threads, sizeof(int));
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+#ifdef _OPENMP
+        int thread = omp_get_thread_num();
+#else
+        int thread = 0;
+#endif
+        ScoredIndex *heap = heaps + (size_t)thread * k;
+        int size = 0;
+        #pragma omp for schedule(static)
+        for (int i = 0; i < num_samples; i++) {
+            ScoredIndex candidate;
+            candidate.index = i;
+            if (mode == TOPK_POSITIVE) {
+                candidate.key = scores[i];
+            } else if (mode == TOPK_NEGATIVE) {
+                candidate.key = -scores[i];
+            } else {
+                candidate.key = -fabsf(scores[i] - DECISION_THRESHOLD);
+            }
+            // Cheap rejection against the current worst entry keeps the loop bandwidth bound
+            if (size == k && !scoredIndexBefore(candidate, heap[0])) {
+                continue;
+            }
+            size = scoredIndexOffer(heap, size, k, candidate);
+        }
+        heap_sizes[thread] = size;
+    }
+
+    // Merge the per-thread heaps
+    int size = 0;
+    for (int t = 0; t < num_threads; t++) {
+        for (int e = 0; e < heap_sizes[t]; e++) {
+            size = scoredIndexOffer(selected, size, k, heaps[(size_t)t * k + e]);
+        }
+    }
+    // Heap sort: move the last ranked entry to the back until the array is ordered best first
+    for (int end = size - 1; end > 0; end--) {
+        ScoredIndex temp = selected[0];
+        selected[0] = selected[end];
+        selected[end] = temp;
+        scoredIndexSiftDown(selected, end, 0);
+    }
+
+    free(heaps);
+    free(heap_sizes);
+    return size;
+}
+
+// Compare two floats in descending order for qsort
+int compareFloatsDescending(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x < y) - (x > y);
+}
+
+// Print the most positive, most negative and most uncertain test tweets
+void runTopK(Post *testSet, const float *scores, int num_samples, int k) {
+    static const char *titles[3] = { "Most Positive", "Most Negative", "Most Uncertain" };
+    ScoredIndex *selected = (ScoredIndex *)safe_malloc(3 * (size_t)k * sizeof(ScoredIndex), "selected");
+    int counts[3];
+
+    // Select all three lists before printing, so the time covers only the selection
+    double start_time = wallSeconds(); // Start time measurement
+    for (int mode = TOPK_POSITIVE; mode <= TOPK_UNCERTAIN; mode++) {
+        counts[mode] = topKSelect(scores, num_samples, k, (TopKMode)mode, selected + (size_t)mode * k);
+    }
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+
+    for (int mode = TOPK_POSITIVE; mode <= TOPK_UNCERTAIN; mode++) {
+        printf("%s %d Tweets:\n", titles[mode], counts[mode]);
+        for (int e = 0; e < counts[mode]; e++) {
+            int i = selected[(size_t)mode * k + e].index;
+            printf("  %.4f  %.*s\n", scores[i], testSet[i].text.length, testSet[i].text.data);
+        }
+    }
+
+    // Baseline: sorting a copy of every score
+    float *sorted = (float *)safe_malloc(num_samples * sizeof(float), "sorted");
+    memcpy(sorted, scores, num_samples * sizeof(float));
+    double sort_start = wallSeconds();
+    qsort(sorted, num_samples, sizeof(float), compareFloatsDescending);
+    double sort_time = wallSeconds() - sort_start;
+    free(sorted);
+
+    printf("Top-K Selection Time: %.4f seconds for 3 selections (full sort %.4f seconds)\n", execution_time, sort_time);
+    free(selected);
+}
+
+// Squared L2 distance, portable version (vectorized by the compiler where possible)
+static float l2SquaredScalar(const float *a, const float *b, int dim) {
+    float sum = 0.0f;
+    #pragma omp simd reduction(+:sum)
+    for (int d = 0; d < dim; d++) {
+        float diff = a[d] - b[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Squared L2 distance with AVX2 + FMA, 8 floats per step
+__attribute__((target("avx2,fma"))) static float l2SquaredAvx2(const float *a, const float *b, int dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int d = 0;
+    for (; d + 16 <= dim; d += 16) {
+        __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(a + d), _mm256_loadu_ps(b + d));
+        __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(a + d + 8), _mm256_loadu_ps(b + d + 8));
+        acc0 = _mm256_fmadd_ps(diff0, diff0, acc0);
+        acc1 = _mm256_fmadd_ps(diff1, diff1, acc1);
+    }
+    for (; d + 8 <= dim; d += 8) {
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + d), _mm256_loadu_ps(b + d));
+        acc0 = _mm256_fmadd_ps(diff, diff, acc0);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+    float sum = _mm_cvtss_f32(sum4);
+    for (; d < dim; d++) {
+        float diff = a[d] - b[d];
+        sum += diff * diff;
+    }
+    return sum;
+}
+#endif
+
+// Distance kernel used by the kNN index, picked for the running CPU by selectDistanceKernel
+static float (*l2Squared)(const float *, const float *, int) = l2SquaredScalar;
+
+void selectDistanceKernel(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        l2Squared = l2SquaredAvx2;
+        printf("Distance kernel: AVX2\n");
+        return;
+    }
+#endif
+    printf("Distance kernel: scalar\n");
+}
+
+// Embed a tweet: every hashed word token adds a seeded random +-1 vector (a sign random
+// projection of the hashed bag of words) and the sum is L2 normalized
+void embedTweet(StringView text, float *embedding, uint64_t seed) {
+    uint32_t hashes[MAX_TOKENS];
+    int count = hashTokens(text, hashes, MAX_TOKENS);
+    for (int d = 0; d < EMBED_DIM; d++) {
+        embedding[d] = 0.0f;
+    }
+    for (int t = 0; t < count; t++) {
+        for (int block = 0; block < EMBED_DIM / 128 + (EMBED_DIM % 128 != 0); block++) {
+            uint32_t r[4];
+            philoxBlock(seed, STREAM_PROJECTION, ((uint64_t)block << 32) | hashes[t], r);
+            for (int d = block * 128; d < EMBED_DIM && d < (block + 1) * 128; d++) {
+                uint32_t bit = (r[(d % 128) / 32] >> (d % 32)) & 1u;
+                embedding[d] += bit ? 1.0f : -1.0f;
+            }
+        }
+    }
+    float norm = 0.0f;
+    for (int d = 0; d < EMBED_DIM; d++) {
+        norm += embedding[d] * embedding[d];
+    }
+    if (norm > 0.0f) {
+        float scale = 1.0f / sqrtf(norm);
+        for (int d = 0; d < EMBED_DIM; d++) {
+            embedding[d] *= scale;
+        }
+    }
+}
+
+// Embed every tweet of a dataset into rows of EMBED_DIM floats
+float *embedDataset(Post *dataset, int num_samples, uint64_t seed) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    float *embeddings = (float *)safe_malloc((size_t)num_samples * EMBED_DIM * sizeof(float), "embeddings");
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < num_samples; i++) {
+        embedTweet(dataset[i].text, embeddings + (size_t)i * EMBED_DIM, seed);
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("Embedding Time: %.4f seconds\n", execution_time);
+    return embeddings;
+}
+
+#ifdef _OPENMP
+typedef omp_lock_t NodeLock;
+#define nodeLockInit(lock) omp_init_lock(lock)
+#define nodeLockDestroy(lock) omp_destroy_lock(lock)
+#define nodeLock(lock) omp_set_lock(lock)
+#define nodeUnlock(lock) omp_unset_lock(lock)
+#else
+typedef int NodeLock;
+#define nodeLockInit(lock) ((void)(lock))
+#define nodeLockDestroy(lock) ((void)(lock))
+#define nodeLock(lock) ((void)(lock))
+#define nodeUnlock(lock) ((void)(lock))
+#endif
+
+// FNV-1a over the labels and texts of a split, to compare loaders and to
+// tell which training split a saved index was built from
+uint64_t datasetChecksum(const Post *posts, int num_samples, uint64_t hash) {
+    for (int i = 0; i < num_samples; i++) {
+        hash = (hash ^ (uint64_t)(uint32_t)posts[i].label) * 1099511628211ull;
+        for (int c = 0; c < posts[i].text.length; c++) {
+            hash = (hash ^ (uint8_t)posts[i].text.data[c]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// On-disk header of a saved HNSW index; the arrays follow in the order of the HnswIndex fields
+typedef struct {
+    char magic[8];
+    uint64_t seed;
+    uint64_t train_checksum; // datasetChecksum of the training split the index was built from
+    int32_t num_nodes;
+    int32_t dim;
+    int32_t m;
+    int32_t m0;
+    int32_t max_level;
+    int32_t entry_point;
+    int64_t num_upper_blocks;
+} HnswFileHeader;
+
+// Hierarchical navigable small world graph over the training embeddings. Level 0 links
+// of node i live in links0[i * (HNSW_M0 + 1)], links on level l > 0 in upper_links at block
+// upper_offsets[i] + l - 1 (blocks of HNSW_M + 1). The first entry of a list is its length.
+typedef struct {
+    int num_nodes;
+    int max_level;
+    int entry_point;
+    long long num_upper_blocks;
+    const float *vectors;
+    const int *labels;
+    int *levels;
+    uint32_t *upper_offsets;
+    uint32_t *links0;
+    uint32_t *upper_links;
+    void *mapping;       // Non-NULL when the index is memory mapped from a file
+    size_t mapping_size;
+} HnswIndex;
+
+// Per-thread scratch space for graph searches
+typedef struct {
+    uint32_t *visited;   // visited[i] == tag when node i was seen by the current search
+    uint32_t tag;
+    ScoredIndex *candidates;
+    int candidate_capacity;
+    ScoredIndex *results;
+    int result_capacity;
+} HnswSearchContext;
+
+static inline uint32_t *hnswLinks(const HnswIndex *index, int node, int level) {
+    if (level == 0) {
+        return index->links0 + (size_t)node * (HNSW_M0 + 1);
+    }
+    return index->upper_links + ((size_t)index->upper_offsets[node] + level - 1) * (HNSW_M + 1);
+}
+
+void hnswContextInit(HnswSearchContext *context, int num_nodes, int capacity) {
+    context->visited = (uint32_t *)calloc(num_nodes, sizeof(uint32_t));
+    context->tag = 0;
+    context->candidate_capacity = capacity;
+    context->candidates = (ScoredIndex *)safe_malloc(capacity * sizeof(ScoredIndex), "candidates");
+    context->result_capacity = capacity;
+    context->results = (ScoredIndex *)safe_malloc(capacity * sizeof(ScoredIndex), "results");
+    if (!context->visited) {
+        printf("Error: Memory allocation failed for visited.\n");
+        exit(1);
+    }
+}
+
+void hnswContextFree(HnswSearchContext *context) {
+    free(context->visited);
+    free(context->candidates);
+    free(context->results);
+}
+
+// Pop the nearest candidate of a heap keyed by distance (root = smallest key)
+static inline ScoredIndex hnswPopNearest(ScoredIndex *heap, int *size) {
+    ScoredIndex top = heap[0];
+    heap[0] = heap[--(*size)];
+    scoredIndexSiftDown(heap, *size, 0);
+    return top;
+}
+
+// Beam search on one level: returns the number of results (at most ef) in context->results,
+// sorted by increasing distance. Keys of the results are distances.
+int hnswSearchLayer(const HnswIndex *index, HnswSearchContext *context, const float *query, int entry, int ef,
+                    int level, NodeLock *locks) {
+    if (ef > context->result_capacity) {
+        ScoredIndex *results = (ScoredIndex *)realloc(context->results, ef * sizeof(ScoredIndex));
+        if (!results) {
+            printf("Error: Memory reallocation failed.\n");
+            exit(1);
+        }
+        context->results = results;
+        context->result_capacity = ef;
+    }
+    if (++context->tag == 0) {
+        memset(context->visited, 0, index->num_nodes * sizeof(uint32_t));
+        context->tag = 1;
+    }
+    // candidates: key = distance, root = nearest; results: key = -distance, root = farthest
+    int num_candidates = 0, num_results = 0;
+    float entry_distance = l2Squared(query, index->vectors + (size_t)entry * EMBED_DIM, EMBED_DIM);
+    ScoredIndex start = { entry_distance, entry };
+    ScoredIndex start_result = { -entry_distance, entry };
+    num_candidates = scoredIndexOffer(context->candidates, num_candidates, context->candidate_capacity, start);
+    num_results = scoredIndexOffer(context->results, num_results, ef, start_result);
+    context->visited[entry] = context->tag;
+
+    uint32_t neighbors[HNSW_M0 + 1];
+    while (num_candidates > 0) {
+        ScoredIndex current = hnswPopNearest(context->candidates, &num_candidates);
+        if (num_results == ef && current.key > -context->results[0].key) {
+            break; // Nearest candidate is farther than every result
+        }
+        const uint32_t *links = hnswLinks(index, current.index, level);
+        if (locks) {
+            nodeLock(&locks[current.index]);
+        }
+        memcpy(neighbors, links, (links[0] + 1) * sizeof(uint32_t));
+        if (locks) {
+            nodeUnlock(&locks[current.index]);
+        }
+        for (uint32_t n = 1; n <= neighbors[0]; n++) {
+            int neighbor = (int)neighbors[n];
+            if (context->visited[neighbor] == context->tag) {
+                continue;
+            }
+            context->visited[neighbor] = context->tag;
+            float distance = l2Squared(query, index->vectors + (size_t)neighbor * EMBED_DIM, EMBED_DIM);
+            if (num_results < ef || distance < -context->results[0].key) {
+                if (num_candidates == context->candidate_capacity) {
+                    ScoredIndex *candidates = (ScoredIndex *)realloc(context->candidates,
+                                                                     2 * context->candidate_capacity * sizeof(ScoredIndex));
+                    if (!candidates) {
+                        printf("Error: Memory reallocation failed.\n");
+                        exit(1);
+                    }
+                    context->candidates = candidates;
+                    context->candidate_capacity *= 2;
+                }
+                ScoredIndex candidate = { distance, neighbor };
+                ScoredIndex result = { -distance, neighbor };
+                num_candidates = scoredIndexOffer(context->candidates, num_candidates, context->candidate_capacity, candidate);
+                num_results = scoredIndexOffer(context->results, num_results, ef, result);
+            }
+        }
+    }
+
+    // Heap sort puts the results nearest first; turn keys back into distances
+    for (int end = num_results - 1; end > 0; end--) {
+        ScoredIndex temp = context->results[0];
+        context->results[0] = context->results[end];
+        context->results[end] = temp;
+        scoredIndexSiftDown(context->results, end, 0);
+    }
+    for (int r = 0; r < num_results; r++) {
+        context->results[r].key = -context->results[r].key;
+    }
+    return num_results;
+}
+
+// HNSW neighbor selection heuristic: take candidates nearest first and keep one only if it
+// is closer to the base than to every neighbor kept so far. Writes the list to links.
+void hnswSelectNeighbors(const HnswIndex *index, const ScoredIndex *candidates, int num_candidates,
+                         int max_links, uint32_t *links) {
+    uint32_t count = 0;
+    for (int c = 0; c < num_candidates && (int)count < max_links; c++) {
+        const float *vector = index->vectors + (size_t)candidates[c].index * EMBED_DIM;
+        int keep = 1;
+        for (uint32_t s = 1; s <= count; s++) {
+            if (l2Squared(vector, index->vectors + (size_t)links[s] * EMBED_DIM, EMBED_DIM) < candidates[c].key) {
+                keep = 0;
+                break;
+            }
+        }
+        if (keep) {
+            links[++count] = (uint32_t)candidates[c].index;
+        }
+    }
+    links[0] = count;
+}
+
+// Link node `node` into the graph (called concurrently for different nodes)
+void hnswInsert(HnswIndex *index, HnswSearchContext *context, int node, NodeLock *locks, NodeLock *global_lock) {
+    const float *query = index->vectors + (size_t)node * EMBED_DIM;
+    int level = index->levels[node];
+
+    nodeLock(global_lock);
+    int max_level = index->max_level;
+    int entry = index->entry_point;
+    int raises_max = level > max_level;
+    if (!raises_max) {
+        nodeUnlock(global_lock); // Only a new top level keeps the global lock for the whole insert
+    }
+
+    // Greedy descent through the levels above the node's own
+    float entry_distance = l2Squared(query, index->vectors + (size_t)entry * EMBED_DIM, EMBED_DIM);
+    for (int l = max_level; l > level; l--) {
+        int changed = 1;
+        while (changed) {
+            changed = 0;
+            uint32_t neighbors[HNSW_M + 1];
+            nodeLock(&locks[entry]);
+            const uint32_t *links = hnswLinks(index, entry, l);
+            memcpy(neighbors, links, (links[0] + 1) * sizeof(uint32_t));
+            nodeUnlock(&locks[entry]);
+            for (uint32_t n = 1; n <= neighbors[0]; n++) {
+                float distance = l2Squared(query, index->vectors + (size_t)neighbors[n] * EMBED_DIM, EMBED_DIM);
+                if (distance < entry_distance) {
+                    entry_distance = distance;
+                    entry = (int)neighbors[n];
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    ScoredIndex *pruned = (ScoredIndex *)safe_malloc((HNSW_M0 + 1) * sizeof(ScoredIndex), "pruned");
+    for (int l = (level < max_level ? level : max_level); l >= 0; l--) {
+        int max_links = l == 0 ? HNSW_M0 : HNSW_M;
+        int found = hnswSearchLayer(index, context, query, entry, HNSW_EF_CONSTRUCTION, l, locks);
+        entry = context->results[0].index;
+
+        nodeLock(&locks[node]);
+        hnswSelectNeighbors(index, context->results, found, HNSW_M, hnswLinks(index, node, l));
+        uint32_t selected[HNSW_M + 1];
+        memcpy(selected, hnswLinks(index, node, l), (hnswLinks(index, node, l)[0] + 1) * sizeof(uint32_t));
+        nodeUnlock(&locks[node]);
+
+        // Add the reverse links, pruning a neighbor's list with the heuristic when it is full
+        for (uint32_t s = 1; s <= selected[0]; s++) {
+            int neighbor = (int)selected[s];
+            nodeLock(&locks[neighbor]);
+            uint32_t *links = hnswLinks(index, neighbor, l);
+            if ((int)links[0] < max_links) {
+                links[++links[0]] = (uint32_t)node;
+            } else {
+                const float *base = index->vectors + (size_t)neighbor * EMBED_DIM;
+                int num_pruned = 0;
+                for (uint32_t n = 1; n <= links[0]; n++) {
+                    ScoredIndex candidate = { l2Squared(base, index->vectors + (size_t)links[n] * EMBED_DIM, EMBED_DIM), (int)links[n] };
+                    pruned[num_pruned++] = candidate;
+                }
+                ScoredIndex candidate = { l2Squared(base, query, EMBED_DIM), node };
+                pruned[num_pruned++] = candidate;
+                // Nearest first
+                for (int a = 1; a < num_pruned; a++) {
+                    ScoredIndex key = pruned[a];
+                    int b = a - 1;
+                    while (b >= 0 && pruned[b].key > key.key) {
+                        pruned[b + 1] = pruned[b];
+                        b--;
+                    }
+                    pruned[b + 1] = key;
+                }
+                hnswSelectNeighbors(index, pruned, num_pruned, max_links, links);
+            }
+            nodeUnlock(&locks[neighbor]);
+        }
+    }
+    free(pruned);
+
+    if (raises_max) {
+        index->max_level = level;
+        index->entry_point = node;
+        nodeUnlock(global_lock);
+    }
+}
+
+// Build an HNSW index over vectors in parallel. Node levels are drawn from the seed; the
+// graph itself depends on the insertion interleaving of the threads.
+void hnswBuild(HnswIndex *index, const float *vectors, const int *labels, int num_nodes, uint64_t seed) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    memset(index, 0, sizeof(*index));
+    index->num_nodes = num_nodes;
+    index->vectors = vectors;
+    index->labels = labels;
+    index->levels = (int *)safe_malloc(num_nodes * sizeof(int), "levels");
+    index->upper_offsets = (uint32_t *)safe_malloc(num_nodes * sizeof(uint32_t), "upper_offsets");
+
+    // Level of each node: floor(-ln(U) / ln(M)), exponentially fewer nodes per level
+    double level_scale = 1.0 / log((double)HNSW_M);
+    long long upper_blocks = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_LEVELS, (uint64_t)i, r);
+        int level = (int)(-log((double)philoxUniform(r[0])) * level_scale);
+        index->levels[i] = level < HNSW_MAX_LEVEL ? level : HNSW_MAX_LEVEL;
+        index->upper_offsets[i] = (uint32_t)upper_blocks;
+        upper_blocks += index->levels[i];
+    }
+    index->num_upper_blocks = upper_blocks;
+    index->links0 = (uint32_t *)calloc((size_t)num_nodes * (HNSW_M0 + 1), sizeof(uint32_t));
+    index->upper_links = (uint32_t *)calloc((size_t)(upper_blocks > 0 ? upper_blocks : 1) * (HNSW_M + 1), sizeof(uint32_t));
+    NodeLock *locks = (NodeLock *)safe_malloc(num_nodes * sizeof(NodeLock), "locks");
+    if (!index->links0 || !index->upper_links) {
+        printf("Error: Memory allocation failed for HNSW links.\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        nodeLockInit(&locks[i]);
+    }
+    NodeLock global_lock;
+    nodeLockInit(&global_lock);
+
+    index->entry_point = 0;
+    index->max_level = index->levels[0];
+    #pragma omp parallel
+    {
+        HnswSearchContext context;
+        hnswContextInit(&context, num_nodes, 4 * HNSW_EF_CONSTRUCTION);
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 1; i < num_nodes; i++) {
+            hnswInsert(index, &context, i, locks, &global_lock);
+        }
+        hnswContextFree(&context);
+    }
+
+    for (int i = 0; i < num_nodes; i++) {
+        nodeLockDestroy(&locks[i]);
+    }
+    nodeLockDestroy(&global_lock);
+    free(locks);
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("HNSW Build Time: %.4f seconds (%d nodes, %d levels)\n", execution_time, num_nodes, index->max_level + 1);
+}
+
+// k nearest neighbors of query: greedy descent to level 0, then a beam search of width ef.
+// Returns the number of neighbors written to neighbors (nearest first).
+int hnswSearch(const HnswIndex *index, HnswSearchContext *context, const float *query, int k, int ef, ScoredIndex *neighbors) {
+    int entry = index->entry_point;
+    float entry_distance = l2Squared(query, index->vectors + (size_t)entry * EMBED_DIM, EMBED_DIM);
+    for (int l = index->max_level; l > 0; l--) {
+        int changed = 1;
+        while (changed) {
+            changed = 0;
+            const uint32_t *links = hnswLinks(index, entry, l);
+            for (uint32_t n = 1; n <= links[0]; n++) {
+                float distance = l2Squared(query, index->vectors + (size_t)links[n] * EMBED_DIM, EMBED_DIM);
+                if (distance < entry_distance) {
+                    entry_distance = distance;
+                    entry = (int)links[n];
+                    changed = 1;
+                }
+            }
+        }
+    }
+    int found = hnswSearchLayer(index, context, query, entry, ef > k ? ef : k, 0, NULL);
+    int count = found < k ? found : k;
+    memcpy(neighbors, context->results, count * sizeof(ScoredIndex));
+    return count;
+}
+
+// Write an index and the vectors and labels it refers to into one file
+void hnswSave(const HnswIndex *index, const char *path, uint64_t seed, uint64_t train_checksum) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Error: Could not open file %s\n", path);
+        exit(1);
+    }
+    HnswFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HNSW_MAGIC, sizeof(header.magic));
+    header.seed = seed;
+    header.train_checksum = train_checksum;
+    header.num_nodes = index->num_nodes;
+    header.dim = EMBED_DIM;
+    header.m = HNSW_M;
+    header.m0 = HNSW_M0;
+    header.max_level = index->max_level;
+    header.entry_point = index->entry_point;
+    header.num_upper_blocks = index->num_upper_blocks;
+    size_t n = (size_t)index->num_nodes;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(index->vectors, sizeof(float), n * EMBED_DIM, file) == n * EMBED_DIM &&
+             fwrite(index->labels, sizeof(int), n, file) == n &&
+             fwrite(index->levels, sizeof(int), n, file) == n &&
+             fwrite(index->upper_offsets, sizeof(uint32_t), n, file) == n &&
+             fwrite(index->links0, sizeof(uint32_t), n * (HNSW_M0 + 1), file) == n * (HNSW_M0 + 1) &&
+             fwrite(index->upper_links, sizeof(uint32_t), (size_t)index->num_upper_blocks * (HNSW_M + 1), file) ==
+                 (size_t)index->num_upper_blocks * (HNSW_M + 1);
+    if (fclose(file) != 0 || !ok) {
+        printf("Error: Could not write HNSW index %s\n", path);
+        exit(1);
+    }
+    printf("HNSW index saved to %s\n", path);
+}
+
+// Check the levels and links of a mapped index before they are used as indexes
+static int hnswValidate(const HnswFileHeader *header, const int *levels, const uint32_t *upper_offsets,
+                        const uint32_t *links0, const uint32_t *upper_links) {
+    int n = header->num_nodes;
+    if (n < 1 || header->max_level < 0 || header->max_level > HNSW_MAX_LEVEL || header->entry_point < 0 ||
+        header->entry_point >= n || header->num_upper_blocks < 0 || levels[header->entry_point] != header->max_level) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (levels[i] < 0 || levels[i] > header->max_level ||
+            (levels[i] > 0 && (long long)upper_offsets[i] + levels[i] > header->num_upper_blocks)) {
+            return 0;
+        }
+        const uint32_t *links = links0 + (size_t)i * (HNSW_M0 + 1);
+        if (links[0] > HNSW_M0) {
+            return 0;
+        }
+        for (uint32_t k = 1; k <= links[0]; k++) {
+            if (links[k] >= (uint32_t)n) {
+                return 0;
+            }
+        }
+    }
+    for (long long b = 0; b < header->num_upper_blocks; b++) {
+        const uint32_t *links = upper_links + (size_t)b * (HNSW_M + 1);
+        if (links[0] > HNSW_M) {
+            return 0;
+        }
+        for (uint32_t k = 1; k <= links[0]; k++) {
+            if (links[k] >= (uint32_t)n) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Map a saved index read-only. Returns 0 when the file is missing, damaged, or was built
+// for a different seed or training split, so the caller rebuilds it.
+int hnswLoad(HnswIndex *index, const char *path, uint64_t seed, int num_nodes, uint64_t train_checksum) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HnswFileHeader)) {
+        close(fd);
+        return 0;
+    }
+    void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+    const HnswFileHeader *header = (const HnswFileHeader *)mapping;
+    size_t n = (size_t)header->num_nodes;
+    size_t expected = sizeof(HnswFileHeader) + n * EMBED_DIM * sizeof(float) + 3 * n * sizeof(int) +
+                      n * (HNSW_M0 + 1) * sizeof(uint32_t) + (size_t)header->num_upper_blocks * (HNSW_M + 1) * sizeof(uint32_t);
+    if (memcmp(header->magic, HNSW_MAGIC, sizeof(header->magic)) != 0 || header->seed != seed ||
+        header->num_nodes != num_nodes || header->train_checksum != train_checksum || header->dim != EMBED_DIM ||
+        header->m != HNSW_M || header->m0 != HNSW_M0 || (size_t)st.st_size != expected) {
+        printf("HNSW index %s does not match this run, rebuilding\n", path);
+        munmap(mapping, (size_t)st.st_size);
+        return 0;
+    }
+    char *cursor = (char *)mapping + sizeof(HnswFileHeader);
+    memset(index, 0, sizeof(*index));
+    index->num_nodes = header->num_nodes;
+    index->max_level = header->max_level;
+    index->entry_point = header->entry_point;
+    index->num_upper_blocks = header->num_upper_blocks;
+    index->vectors = (const float *)cursor;
+    cursor += n * EMBED_DIM * sizeof(float);
+    index->labels = (const int *)cursor;
+    cursor += n * sizeof(int);
+    index->levels = (int *)cursor;
+    cursor += n * sizeof(int);
+    index->upper_offsets = (uint32_t *)cursor;
+    cursor += n * sizeof(uint32_t);
+    index->links0 = (uint32_t *)cursor;
+    cursor += n * (HNSW_M0 + 1) * sizeof(uint32_t);
+    index->upper_links = (uint32_t *)cursor;
+    if (!hnswValidate(header, index->levels, index->upper_offsets, index->links0, index->upper_links)) {
+        printf("HNSW index %s is damaged, rebuilding\n", path);
+        munmap(mapping, (size_t)st.st_size);
+        return 0;
+    }
+    index->mapping = mapping;
+    index->mapping_size = (size_t)st.st_size;
+    printf("HNSW index mapped from %s (%d nodes)\n", path, index->num_nodes);
+    return 1;
+}
+
+void hnswFree(HnswIndex *index) {
+    if (index->mapping) {
+        munmap(index->mapping, index->mapping_size);
+        return;
+    }
+    free(index->levels);
+    free(index->upper_offsets);
+    free(index->links0);
+    free(index->upper_links);
+}
+
+// Exact k nearest neighbors by brute force (for measuring recall)
+int bruteForceKnn(const float *vectors, int num_nodes, const float *query, int k, ScoredIndex *neighbors) {
+    int size = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        ScoredIndex candidate = { -l2Squared(query, vectors + (size_t)i * EMBED_DIM, EMBED_DIM), i };
+        size = scoredIndexOffer(neighbors, size, k, candidate);
+    }
+    return size;
+}
+
+// kNN classifier: build (or map) an HNSW index over the training embeddings, classify the test
+// tweets by majority vote of their k nearest neighbors and report queries/s at several recalls
+void runKnn(Post *trainSet, int *trainLabels, int trainSize, Post *testSet, int *testLabels, int testSize,
+            int k, int ef, const char *index_path, uint64_t seed) {
+    printf("Running kNN classifier (k = %d, ef = %d)...\n", k, ef);
+    selectDistanceKernel();
+
+    HnswIndex index;
+    float *train_embeddings = NULL;
+    uint64_t train_checksum = index_path ? datasetChecksum(trainSet, trainSize, 14695981039346656037ull) : 0;
+    if (!index_path || !hnswLoad(&index, index_path, seed, trainSize, train_checksum)) {
+        train_embeddings = embedDataset(trainSet, trainSize, seed);
+        hnswBuild(&index, train_embeddings, trainLabels, trainSize, seed);
+        if (index_path) {
+            hnswSave(&index, index_path, seed, train_checksum);
+        }
+    }
+    float *test_embeddings = embedDataset(testSet, testSize, seed);
+
+    // Classify the test set
+    int correct = 0;
+    double start_time = wallSeconds(); // Start time measurement
+    #pragma omp parallel reduction(+:correct)
+    {
+        HnswSearchContext context;
+        hnswContextInit(&context, index.num_nodes, 4 * (ef > k ? ef : k));
+        ScoredIndex *neighbors = (ScoredIndex *)safe_malloc(k * sizeof(ScoredIndex), "neighbors");
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < testSize; i++) {
+            int found = hnswSearch(&index, &context, test_embeddings + (size_t)i * EMBED_DIM, k, ef, neighbors);
+            int positive = 0;
+            for (int n = 0; n < found; n++) {
+                positive += index.labels[neighbors[n].index] == 4;
+            }
+            // Majority vote; ties go to the nearest neighbor
+            int predicted_label = 2 * positive > found ? 4 : (2 * positive < found ? 0 : index.labels[neighbors[0].index]);
+            correct += (found > 0 && predicted_label == testLabels[i]);
+        }
+        free(neighbors);
+        hnswContextFree(&context);
+    }
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("kNN Classification Time: %.4f seconds (%.0f queries/s)\n", execution_time, testSize / execution_time);
+    printf("kNN Test set Accuracy: %.2f%%\n", 100.0 * correct / testSize);
+
+    // Recall@k against brute force on a sample of queries, for a sweep of beam widths
+    int num_queries = testSize < 1000 ? testSize : 1000;
+    ScoredIndex *exact = (ScoredIndex *)safe_malloc((size_t)num_queries * k * sizeof(ScoredIndex), "exact");
+    int *exact_counts = (int *)safe_malloc(num_queries * sizeof(int), "exact_counts");
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int q = 0; q < num_queries; q++) {
+        exact_counts[q] = bruteForceKnn(index.vectors, index.num_nodes, test_embeddings + (size_t)q * EMBED_DIM, k,
+                                        exact + (size_t)q * k);
+    }
+    static const int sweep[] = { 16, 32, 64, 128, 256 };
+    printf("%8s %12s %10s\n", "ef", "queries/s", "recall@k");
+    for (int s = 0; s < (int)(sizeof(sweep) / sizeof(sweep[0])); s++) {
+        long long hits = 0, total = 0;
+        double sweep_start = wallSeconds();
+        #pragma omp parallel reduction(+:hits, total)
+        {
+            HnswSearchContext context;
+            hnswContextInit(&context, index.num_nodes, 4 * sweep[s]);
+            ScoredIndex *neighbors = (ScoredIndex *)safe_malloc(k * sizeof(ScoredIndex), "neighbors");
+            #pragma omp for schedule(dynamic, 16)
+            for (int q = 0; q < num_queries; q++) {
+                int found = hnswSearch(&index, &context, test_embeddings + (size_t)q * EMBED_DIM, k, sweep[s], neighbors);
+                for (int a = 0; a < found; a++) {
+                    for (int b = 0; b < exact_counts[q]; b++) {
+                        if (neighbors[a].index == exact[(size_t)q * k + b].index) {
+                            hits++;
+                            break;
+                        }
+                    }
+                }
+                total += exact_counts[q];
+            }
+            free(neighbors);
+            hnswContextFree(&context);
+        }
+        double sweep_time = wallSeconds() - sweep_start;
+        printf("%8d %12.0f %9.2f%%\n", sweep[s], num_queries / sweep_time, 100.0 * hits / (total > 0 ? total : 1));
+    }
+
+    free(exact);
+    free(exact_counts);
+    free(test_embeddings);
+    hnswFree(&index);
+    free(train_embeddings);
+}
+
+// Product quantizer: EMBED_DIM is split into PQ_M subvectors of PQ_SUBDIM floats, each
+// replaced by the 8-bit index of its nearest centroid. Codes are stored in blocks of
+// PQ_BLOCK vectors, subquantizer-major inside a block, so a SIMD register holds the codes
+// of PQ_BLOCK vectors for one subquantizer.
+typedef struct {
+    float centroids[PQ_M][PQ_CENTROIDS][PQ_SUBDIM];
+    int num_vectors;
+    int num_blocks;
+    uint8_t *codes; // num_blocks * PQ_M * PQ_BLOCK bytes
+} ProductQuantizer;
+
+// Train every subquantizer's codebook with Lloyd's k-means on up to PQ_TRAIN_SAMPLES vectors
+void pqTrain(ProductQuantizer *pq, const float *vectors, int num_vectors, uint64_t seed) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    int num_samples = num_vectors < PQ_TRAIN_SAMPLES ? num_vectors : PQ_TRAIN_SAMPLES;
+    int *samples = (int *)safe_malloc(num_vectors * sizeof(int), "samples");
+    for (int i = 0; i < num_vectors; i++) {
+        samples[i] = i;
+    }
+    // Seeded partial Fisher-Yates: the first num_samples entries are a random sample
+    for (int i = 0; i < num_samples; i++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_PQ, (uint64_t)i, r);
+        int j = i + (int)(((uint64_t)r[0] * (uint64_t)(num_vectors - i)) >> 32);
+        int temp = samples[i];
+        samples[i] = samples[j];
+        samples[j] = temp;
+    }
+
+    int *assignment = (int *)safe_malloc(num_samples * sizeof(int), "assignment");
+    for (int m = 0; m < PQ_M; m++) {
+        float (*centroids)[PQ_SUBDIM] = pq->centroids[m];
+        for (int c = 0; c < PQ_CENTROIDS; c++) {
+            const float *source = vectors + (size_t)samples[c % num_samples] * EMBED_DIM + m * PQ_SUBDIM;
+            memcpy(centroids[c], source, sizeof(centroids[c]));
+        }
+        for (int iteration = 0; iteration < PQ_KMEANS_ITERATIONS; iteration++) {
+            #pragma omp parallel for schedule(static)
+            for (int s = 0; s < num_samples; s++) {
+                const float *sub = vectors + (size_t)samples[s] * EMBED_DIM + m * PQ_SUBDIM;
+                int best = 0;
+                float best_distance = l2Squared(sub, centroids[0], PQ_SUBDIM);
+                for (int c = 1; c < PQ_CENTROIDS; c++) {
+                    float distance = l2Squared(sub, centroids[c], PQ_SUBDIM);
+                    if (distance < best_distance) {
+                        best_distance = distance;
+                        best = c;
+                    }
+                }
+                assignment[s] = best;
+            }
+            double sums[PQ_CENTROIDS][PQ_SUBDIM];
+            int counts[PQ_CENTROIDS];
+            memset(sums, 0, sizeof(sums));
+            memset(counts, 0, sizeof(counts));
+            for (int s = 0; s < num_samples; s++) {
+                const float *sub = vectors + (size_t)samples[s] * EMBED_DIM + m * PQ_SUBDIM;
+                counts[assignment[s]]++;
+                for (int d = 0; d < PQ_SUBDIM; d++) {
+                    sums[assignment[s]][d] += sub[d];
+                }
+            }
+            for (int c = 0; c < PQ_CENTROIDS; c++) {
+                if (counts[c] == 0) {
+                    // Empty cluster: restart it on a random sample
+                    uint32_t r[4];
+                    philoxBlock(seed, STREAM_PQ, ((uint64_t)(m * PQ_KMEANS_ITERATIONS + iteration + 1) << 32) | (uint64_t)c, r);
+                    int s = (int)(((uint64_t)r[0] * (uint64_t)num_samples) >> 32);
+                    memcpy(centroids[c], vectors + (size_t)samples[s] * EMBED_DIM + m * PQ_SUBDIM, sizeof(centroids[c]));
+                    continue;
+                }
+                for (int d = 0; d < PQ_SUBDIM; d++) {
+                    centroids[c][d] = (float)(sums[c][d] / counts[c]);
+                }
+            }
+        }
+    }
+    free(assignment);
+    free(samples);
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("PQ Codebook Training Time: %.4f seconds (%d samples)\n", execution_time, num_samples);
+}
+
+// Encode vectors into blocked 8-bit codes
+void pqEncode(ProductQuantizer *pq, const float *vectors, int num_vectors) {
+    double start_time = wallSeconds(); // Start time measurement
+
+    pq->num_vectors = num_vectors;
+    pq->num_blocks = (num_vectors + PQ_BLOCK - 1) / PQ_BLOCK;
+    pq->codes = (uint8_t *)calloc((size_t)pq->num_blocks * PQ_M * PQ_BLOCK, 1);
+    if (!pq->codes) {
+        printf("Error: Memory allocation failed for PQ codes.\n");
+        exit(1);
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < num_vectors; i++) {
+        uint8_t *block = pq->codes + (size_t)(i / PQ_BLOCK) * PQ_M * PQ_BLOCK;
+        for (int m = 0; m < PQ_M; m++) {
+            const float *sub = vectors + (size_t)i * EMBED_DIM + m * PQ_SUBDIM;
+            int best = 0;
+            float best_distance = l2Squared(sub, pq->centroids[m][0], PQ_SUBDIM);
+            for (int c = 1; c < PQ_CENTROIDS; c++) {
+                float distance = l2Squared(sub, pq->centroids[m][c], PQ_SUBDIM);
+                if (distance < best_distance) {
+                    best_distance = distance;
+                    best = c;
+                }
+            }
+            block[m * PQ_BLOCK + i % PQ_BLOCK] = (uint8_t)best;
+        }
+    }
+
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("PQ Encoding Time: %.4f seconds\n", execution_time);
+}
+
+// Code of vector i for subquantizer m
+static inline uint8_t pqCode(const ProductQuantizer *pq, int i, int m) {
+    return pq->codes[(size_t)(i / PQ_BLOCK) * PQ_M * PQ_BLOCK + m * PQ_BLOCK + i % PQ_BLOCK];
+}
+
+// Asymmetric distance tables for one query: lut[m][c] is the squared distance of the query's
+// m-th subvector to centroid c. quantized holds the same tables as bytes (after removing each
+// table's minimum and scaling by one common factor). Subtracting the minima shifts every sum
+// by the same amount, but rounding each entry to a byte can swap sums that differ by less than
+// PQ_M steps, so the ranking is only approximately preserved; pqSearch re-ranks its
+// byte-distance candidates with the float tables.
+void pqBuildTables(const ProductQuantizer *pq, const float *query, float lut[PQ_M][PQ_CENTROIDS],
+                   uint8_t quantized[PQ_M][PQ_CENTROIDS]) {
+    float minimum[PQ_M];
+    float max_range = 0.0f;
+    for (int m = 0; m < PQ_M; m++) {
+        minimum[m] = INFINITY;
+        float maximum = 0.0f;
+        for (int c = 0; c < PQ_CENTROIDS; c++) {
+            lut[m][c] = l2Squared(query + m * PQ_SUBDIM, pq->centroids[m][c], PQ_SUBDIM);
+            minimum[m] = fminf(minimum[m], lut[m][c]);
+            maximum = fmaxf(maximum, lut[m][c]);
+        }
+        max_range = fmaxf(max_range, maximum - minimum[m]);
+    }
+    float scale = max_range > 0.0f ? 255.0f / max_range : 0.0f;
+    for (int m = 0; m < PQ_M; m++) {
+        for (int c = 0; c < PQ_CENTROIDS; c++) {
+            quantized[m][c] = (uint8_t)lrintf((lut[m][c] - minimum[m]) * scale);
+        }
+    }
+}
+
+// Quantized ADC scan, one table lookup per code
+void pqScanScalar(const ProductQuantizer *pq, const uint8_t quantized[PQ_M][PQ_CENTROIDS], uint16_t *distances) {
+    for (int b = 0; b < pq->num_blocks; b++) {
+        const uint8_t *block = pq->codes + (size_t)b * PQ_M * PQ_BLOCK;
+        uint16_t *out = distances + (size_t)b * PQ_BLOCK;
+        for (int v = 0; v < PQ_BLOCK; v++) {
+            out[v] = 0;
+        }
+        for (int m = 0; m < PQ_M; m++) {
+            for (int v = 0; v < PQ_BLOCK; v++) {
+                out[v] = (uint16_t)(out[v] + quantized[m][block[m * PQ_BLOCK + v]]);
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Quantized ADC scan with byte shuffles: each 256-entry table sits in four registers and
+// two permutex2var lookups plus a blend on the code's top bit translate 64 codes at once
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void pqScanAvx512(const ProductQuantizer *pq, const uint8_t quantized[PQ_M][PQ_CENTROIDS], uint16_t *distances) {
+    __m512i tables[PQ_M][4];
+    for (int m = 0; m < PQ_M; m++) {
+        for (int t = 0; t < 4; t++) {
+            tables[m][t] = _mm512_loadu_si512((const void *)(quantized[m] + 64 * t));
+        }
+    }
+    for (int b = 0; b < pq->num_blocks; b++) {
+        const uint8_t *block = pq->codes + (size_t)b * PQ_M * PQ_BLOCK;
+        __m512i sum_low = _mm512_setzero_si512(), sum_high = _mm512_setzero_si512();
+        for (int m = 0; m < PQ_M; m++) {
+            __m512i codes = _mm512_loadu_si512((const void *)(block + m * PQ_BLOCK));
+            __m512i below = _mm512_permutex2var_epi8(tables[m][0], codes, tables[m][1]);
+            __m512i above = _mm512_permutex2var_epi8(tables[m][2], codes, tables[m][3]);
+            __m512i values = _mm512_mask_blend_epi8(_mm512_movepi8_mask(codes), below, above);
+            sum_low = _mm512_add_epi16(sum_low, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(values)));
+            sum_high = _mm512_add_epi16(sum_high, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(values, 1)));
+        }
+        _mm512_storeu_si512((void *)(distances + (size_t)b * PQ_BLOCK), sum_low);
+        _mm512_storeu_si512((void *)(distances + (size_t)b * PQ_BLOCK + 32), sum_high);
+    }
+}
+#endif
+
+// ADC scan kernel for the running CPU, picked by selectPqScanKernel
+static void (*pqScan)(const ProductQuantizer *, const uint8_t[PQ_M][PQ_CENTROIDS], uint16_t *) = pqScanScalar;
+
+void selectPqScanKernel(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi")) {
+        pqScan = pqScanAvx512;
+        printf("PQ scan kernel: AVX-512 VBMI\n");
+        return;
+    }
+#endif
+    printf("PQ scan kernel: scalar\n");
+}
+
+// k nearest encoded vectors of a query: quantized scan of every code, then the best
+// PQ_RERANK_FACTOR * k candidates are re-ranked with the float tables. Nearest first.
+int pqSearch(const ProductQuantizer *pq, const float *query, int k, uint16_t *distances, ScoredIndex *candidates,
+             ScoredIndex *neighbors) {
+    float lut[PQ_M][PQ_CENTROIDS];
+    uint8_t quantized[PQ_M][PQ_CENTROIDS];
+    pqBuildTables(pq, query, lut, quantized);
+    pqScan(pq, (const uint8_t (*)[PQ_CENTROIDS])quantized, distances);
+
+    int capacity = PQ_RERANK_FACTOR * k;
+    int num_candidates = 0;
+    for (int i = 0; i < pq->num_vectors; i++) {
+        ScoredIndex candidate = { -(float)distances[i], i };
+        if (num_candidates == capacity && !scoredIndexBefore(candidate, candidates[0])) {
+            continue;
+        }
+        num_candidates = scoredIndexOffer(candidates, num_candidates, capacity, candidate);
+    }
+    int count = 0;
+    for (int c = 0; c < num_candidates; c++) {
+        int i = candidates[c].index;
+        float distance = 0.0f;
+        for (int m = 0; m < PQ_M; m++) {
+            distance += lut[m][pqCode(pq, i, m)];
+        }
+        ScoredIndex neighbor = { -distance, i };
+        count = scoredIndexOffer(neighbors, count, k, neighbor);
+    }
+    for (int end = count - 1; end > 0; end--) {
+        ScoredIndex temp = neighbors[0];
+        neighbors[0] = neighbors[end];
+        neighbors[end] = temp;
+        scoredIndexSiftDown(neighbors, end, 0);
+    }
+    return count;
+}
+
+// Nearest-neighbor retrieval over product-quantized training embeddings: reports the
+// compression ratio, scan speed of the scalar and SIMD kernels, recall against exact
+// search and the accuracy of a k nearest neighbor vote
+void runProductQuantization(Post *trainSet, int *trainLabels, int trainSize, Post *testSet, int *testLabels,
+                            int testSize, int k, uint64_t seed) {
+    printf("Running product-quantized retrieval (k = %d, %d x 8-bit codes)...\n", k, PQ_M);
+    selectDistanceKernel();
+    selectPqScanKernel();
+
+    float *train_embeddings = embedDataset(trainSet, trainSize, seed);
+    float *test_embeddings = embedDataset(testSet, testSize, seed);
+    ProductQuantizer *pq = (ProductQuantizer *)safe_malloc(sizeof(ProductQuantizer), "pq");
+    pqTrain(pq, train_embeddings, trainSize, seed);
+    pqEncode(pq, train_embeddings, trainSize);
+
+    double float_bytes = (double)trainSize * EMBED_DIM * sizeof(float);
+    double code_bytes = (double)trainSize * PQ_M;
+    printf("PQ Compression: %.0f bytes -> %.0f bytes of codes + %zu bytes of codebooks (%.1fx)\n", float_bytes,
+           code_bytes, sizeof(pq->centroids), float_bytes / (code_bytes + sizeof(pq->centroids)));
+
+    // Scan speed of both kernels over the same queries; their distances must agree
+    int num_queries = testSize < 200 ? testSize : 200;
+    uint16_t *distances = (uint16_t *)safe_malloc((size_t)pq->num_blocks * PQ_BLOCK * sizeof(uint16_t), "distances");
+    uint16_t *reference = (uint16_t *)safe_malloc((size_t)pq->num_blocks * PQ_BLOCK * sizeof(uint16_t), "reference");
+    void (*kernels[2])(const ProductQuantizer *, const uint8_t[PQ_M][PQ_CENTROIDS], uint16_t *) = { pqScanScalar, pqScan };
+    const char *kernel_names[2] = { "scalar", "selected" };
+    int kernels_agree = 1;
+    for (int kernel = 0; kernel < 2; kernel++) {
+        double scan_time = 0.0;
+        for (int q = 0; q < num_queries; q++) {
+            float lut[PQ_M][PQ_CENTROIDS];
+            uint8_t quantized[PQ_M][PQ_CENTROIDS];
+            pqBuildTables(pq, test_embeddings + (size_t)q * EMBED_DIM, lut, quantized);
+            double start = wallSeconds();
+            kernels[kernel](pq, (const uint8_t (*)[PQ_CENTROIDS])quantized, distances);
+            scan_time += wallSeconds() - start;
+            if (kernel == 0 && q == 0) {
+                memcpy(reference, distances, (size_t)trainSize * sizeof(uint16_t));
+            } else if (kernel == 1 && q == 0) {
+                kernels_agree = memcmp(reference, distances, (size_t)trainSize * sizeof(uint16_t)) == 0;
+            }
+        }
+        double codes_scanned = (double)num_queries * trainSize;
+        printf("PQ Scan (%s): %.1f M codes/s, %.2f GB/s\n", kernel_names[kernel], codes_scanned / scan_time * 1e-6,
+               codes_scanned * PQ_M / scan_time * 1e-9);
+    }
+    printf("PQ SIMD distances match scalar: %s\n", kernels_agree ? "yes" : "NO");
+    free(reference);
+
+    // Recall@k against exact float search on the same queries
+    ScoredIndex *candidates = (ScoredIndex *)safe_malloc((size_t)PQ_RERANK_FACTOR * k * sizeof(ScoredIndex), "candidates");
+    ScoredIndex *neighbors = (ScoredIndex *)safe_malloc(k * sizeof(ScoredIndex), "neighbors");
+    ScoredIndex *exact = (ScoredIndex *)safe_malloc(k * sizeof(ScoredIndex), "exact");
+    long long hits = 0, total = 0;
+    for (int q = 0; q < num_queries; q++) {
+        const float *query = test_embeddings + (size_t)q * EMBED_DIM;
+        int found = pqSearch(pq, query, k, distances, candidates, neighbors);
+        int exact_found = bruteForceKnn(train_embeddings, trainSize, query, k, exact);
+        for (int a = 0; a < found; a++) {
+            for (int b = 0; b < exact_found; b++) {
+                if (neighbors[a].index == exact[b].index) {
+                    hits++;
+                    break;
+                }
+            }
+        }
+        total += exact_found;
+    }
+    printf("PQ Recall@%d: %.2f%% (%d queries)\n", k, 100.0 * hits / (total > 0 ? total : 1), num_queries);
+
+    // Classify the test set by the labels of the retrieved neighbors
+    int correct = 0;
+    double start_time = wallSeconds(); // Start time measurement
+    for (int i = 0; i < testSize; i++) {
+        int found = pqSearch(pq, test_embeddings + (size_t)i * EMBED_DIM, k, distances, candidates, neighbors);
+        int positive = 0;
+        for (int n = 0; n < found; n++) {
+            positive += trainLabels[neighbors[n].index] == 4;
+        }
+        int predicted_label = 2 * positive > found ? 4 : (2 * positive < found ? 0 : trainLabels[neighbors[0].index]);
+        correct += (found > 0 && predicted_label == testLabels[i]);
+    }
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("PQ Classification Time: %.4f seconds (%.0f queries/s)\n", execution_time, testSize / execution_time);
+    printf("PQ kNN Test set Accuracy: %.2f%%\n", 100.0 * correct / testSize);
+
+    free(candidates);
+    free(neighbors);
+    free(exact);
+    free(distances);
+    free(pq->codes);
+    free(pq);
+    free(train_embeddings);
+    free(test_embeddings);
+}
+
+// Permuted-table index over 64-bit SimHash signatures. The signature is cut into
+// SIMHASH_BLOCKS blocks of 16 bits and table b chains together the signatures with the
+// same value in block b. Two signatures within SIMHASH_BLOCKS - 1 bits of each other
+// agree exactly on at least one block, so probing one chain per table finds them all.
+typedef struct {
+    const uint64_t *signatures;
+    int capacity;
+    int *heads[SIMHASH_BLOCKS]; // 65536 chain heads per table, -1 when empty
+    int *next[SIMHASH_BLOCKS];  // Next entry in the same chain
+    int *ids;                   // Signature index of every entry
+    int size;
+    uint32_t *seen;             // Deduplicates entries found through several tables
+    uint32_t tag;
+} SimHashIndex;
+
+static inline uint32_t simHashBlock(uint64_t signature, int block) {
+    return (uint32_t)(signature >> (16 * block)) & 0xFFFFu;
+}
+
+void simHashIndexInit(SimHashIndex *index, const uint64_t *signatures, int capacity) {
+    index->signatures = signatures;
+    index->capacity = capacity;
+    index->size = 0;
+    for (int b = 0; b < SIMHASH_BLOCKS; b++) {
+        index->heads[b] = (int *)safe_malloc(65536 * sizeof(int), "simhashHeads");
+        index->next[b] = (int *)safe_malloc(capacity * sizeof(int), "simhashNext");
+        memset(index->heads[b], 0xFF, 65536 * sizeof(int));
+    }
+    index->ids = (int *)safe_malloc(capacity * sizeof(int), "simhashIds");
+    index->seen = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    index->tag = 0;
+    if (!index->seen) {
+        printf("Error: Memory allocation failed for seen.\n");
+        exit(1);
+    }
+}
+
+void simHashIndexFree(SimHashIndex *index) {
+    for (int b = 0; b < SIMHASH_BLOCKS; b++) {
+        free(index->heads[b]);
+        free(index->next[b]);
+    }
+    free(index->ids);
+    free(index->seen);
+}
+
+// Add signature `id` to every table
+void simHashIndexAdd(SimHashIndex *index, int id) {
+    int entry = index->size++;
+    index->ids[entry] = id;
+    for (int b = 0; b < SIMHASH_BLOCKS; b++) {
+        uint32_t key = simHashBlock(index->signatures[id], b);
+        index->next[b][entry] = index->heads[b][key];
+        index->heads[b][key] = entry;
+    }
+}
+
+// Nearest indexed signature within max_distance bits of signature (-1 when there is none)
+int simHashIndexNearest(SimHashIndex *index, uint64_t signature, int max_distance, int *distance) {
+    if (++index->tag == 0) {
+        memset(index->seen, 0, index->capacity * sizeof(uint32_t));
+        index->tag = 1;
+    }
+    int best = -1, best_distance = max_distance + 1;
+    for (int b = 0; b < SIMHASH_BLOCKS && best_distance > 0; b++) {
+        for (int entry = index->heads[b][simHashBlock(signature, b)]; entry >= 0; entry = index->next[b][entry]) {
+            if (index->seen[entry] == index->tag) {
+                continue;
+            }
+            index->seen[entry] = index->tag;
+            int bits = __builtin_popcountll(signature ^ index->signatures[index->ids[entry]]);
+            if (bits < best_distance) {
+                best_distance = bits;
+                best = index->ids[entry];
+            }
+        }
+    }
+    *distance = best_distance;
+    return best;
+}
+
+// Single-pass (leader) clustering of the training tweets by SimHash, plus near-duplicate
+// lookups of the test tweets against the training signatures
+void runSimHash(Post *trainSet, const uint64_t *trainSignatures, int trainSize, Post *testSet,
+                const uint64_t *testSignatures, int testSize, int max_distance) {
+    printf("Running SimHash clustering (within %d bits)...\n", max_distance);
+
+    // Every tweet joins the nearest leader within max_distance or becomes a new leader
+    double start_time = wallSeconds(); // Start time measurement
+    SimHashIndex leaders;
+    simHashIndexInit(&leaders, trainSignatures, trainSize);
+    int *cluster_of = (int *)safe_malloc(trainSize * sizeof(int), "cluster_of");
+    int *cluster_size = (int *)calloc(trainSize, sizeof(int));
+    int num_clusters = 0;
+    for (int i = 0; i < trainSize; i++) {
+        int distance;
+        int leader = simHashIndexNearest(&leaders, trainSignatures[i], max_distance, &distance);
+        if (leader < 0) {
+            simHashIndexAdd(&leaders, i);
+            leader = i;
+            num_clusters++;
+        }
+        cluster_of[i] = leader;
+        cluster_size[leader]++;
+    }
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("SimHash Clustering Time: %.4f seconds (%.0f tweets/s)\n", execution_time, trainSize / execution_time);
+    printf("SimHash Clusters: %d for %d training tweets\n", num_clusters, trainSize);
+
+    // Largest clusters
+    ScoredIndex largest[5];
+    int count = 0;
+    for (int i = 0; i < trainSize; i++) {
+        if (cluster_size[i] > 1) {
+            ScoredIndex candidate = { (float)cluster_size[i], i };
+            count = scoredIndexOffer(largest, count, 5, candidate);
+        }
+    }
+    for (int end = count - 1; end > 0; end--) {
+        ScoredIndex temp = largest[0];
+        largest[0] = largest[end];
+        largest[end] = temp;
+        scoredIndexSiftDown(largest, end, 0);
+    }
+    for (int c = 0; c < count; c++) {
+        const StringView *text = &trainSet[largest[c].index].text;
+        printf("  %d tweets like: %.*s\n", (int)largest[c].key, text->length, text->data);
+    }
+
+    // Near-duplicates of test tweets among all training tweets
+    SimHashIndex train_index;
+    simHashIndexInit(&train_index, trainSignatures, trainSize);
+    for (int i = 0; i < trainSize; i++) {
+        simHashIndexAdd(&train_index, i);
+    }
+    start_time = wallSeconds();
+    int matched = 0, shown = 0;
+    for (int i = 0; i < testSize; i++) {
+        int distance;
+        int nearest = simHashIndexNearest(&train_index, testSignatures[i], max_distance, &distance);
+        if (nearest >= 0) {
+            matched++;
+            if (shown < 3 && distance > 0) {
+                printf("  test \"%.*s\" ~ train \"%.*s\" (%d bits)\n", testSet[i].text.length, testSet[i].text.data,
+                       trainSet[nearest].text.length, trainSet[nearest].text.data, distance);
+                shown++;
+            }
+        }
+    }
+    execution_time = wallSeconds() - start_time;
+    printf("SimHash Lookup Time: %.4f seconds (%.0f queries/s)\n", execution_time, testSize / execution_time);
+    printf("SimHash Near-duplicates: %d of %d test tweets have a training tweet within %d bits\n", matched, testSize, max_distance);
+
+    simHashIndexFree(&train_index);
+    simHashIndexFree(&leaders);
+    free(cluster_of);
+    free(cluster_size);
+}
+
+// Character CNN: byte embedding, one 1D convolution per width in CNN_WIDTHS with ReLU and
+// max-pooling over time, and a dense output unit
+typedef struct {
+    float embedding[256][CNN_EMBED];
+    float conv_weights[CNN_NUM_WIDTHS][CNN_MAX_WIDTH * CNN_EMBED][CNN_FILTERS]; // (width * CNN_EMBED) x CNN_FILTERS used
+    float conv_biases[CNN_NUM_WIDTHS][CNN_FILTERS];
+    float dense_weights[CNN_NUM_WIDTHS * CNN_FILTERS];
+    float dense_bias;
+} CharCnn;
+
+// Per-thread activations of one tweet, kept for the backward pass
+typedef struct {
+    int length;
+    unsigned char bytes[CNN_MAX_LEN];
+    float inputs[CNN_MAX_LEN * CNN_EMBED];
+    float conv[CNN_MAX_LEN * CNN_FILTERS];
+    float pooled[CNN_NUM_WIDTHS * CNN_FILTERS];
+    int argmax[CNN_NUM_WIDTHS * CNN_FILTERS];
+} CharCnnActivations;
+
+static const int cnn_widths[CNN_NUM_WIDTHS] = CNN_WIDTHS;
+
+// C (rows x CNN_FILTERS) = A (rows x depth, row stride lda) x B (depth x CNN_FILTERS), register
+// tiled 4 rows at a time. A convolution is this GEMM on the embedded tweet: the im2col row of
+// position t is the contiguous slice of width * CNN_EMBED floats starting at t * CNN_EMBED,
+// so lda = CNN_EMBED and no copy is made.
+static void cnnGemm(const float *A, int lda, int rows, int depth, const float *B, float *C) {
+    for (int r0 = 0; r0 < rows; r0 += 4) {
+        int tile = rows - r0 < 4 ? rows - r0 : 4;
+        const float *a[4];
+        for (int r = 0; r < 4; r++) {
+            a[r] = A + (size_t)(r0 + (r < tile ? r : tile - 1)) * lda;
+        }
+        float acc[4][CNN_FILTERS] = {{0.0f}};
+        for (int k = 0; k < depth; k++) {
+            const float *b = B + (size_t)k * CNN_FILTERS;
+            for (int r = 0; r < 4; r++) {
+                float value = a[r][k];
+                for (int f = 0; f < CNN_FILTERS; f++) {
+                    acc[r][f] += value * b[f];
+                }
+            }
+        }
+        for (int r = 0; r < tile; r++) {
+            memcpy(C + (size_t)(r0 + r) * CNN_FILTERS, acc[r], sizeof(acc[r]));
+        }
+    }
+}
+
+// Forward pass of one tweet; returns the logit
+float charCnnForward(const CharCnn *cnn, StringView text, CharCnnActivations *act) {
+    int length = 0;
+    while (length < CNN_MAX_LEN && length < text.length) {
+        act->bytes[length] = (unsigned char)text.data[length];
+        length++;
+    }
+    // Pad short tweets with byte 0 so every width has at least one position
+    while (length < CNN_MAX_WIDTH) {
+        act->bytes[length++] = 0;
+    }
+    act->length = length;
+    for (int t = 0; t < length; t++) {
+        memcpy(act->inputs + t * CNN_EMBED, cnn->embedding[act->bytes[t]], sizeof(cnn->embedding[0]));
+    }
+
+    float logit = cnn->dense_bias;
+    for (int w = 0; w < CNN_NUM_WIDTHS; w++) {
+        int width = cnn_widths[w];
+        int positions = length - width + 1;
+        cnnGemm(act->inputs, CNN_EMBED, positions, width * CNN_EMBED, &cnn->conv_weights[w][0][0], act->conv);
+        for (int f = 0; f < CNN_FILTERS; f++) {
+            // Max-pool of ReLU(conv + bias) over time
+            float best = act->conv[f];
+            int best_t = 0;
+            for (int t = 1; t < positions; t++) {
+                if (act->conv[t * CNN_FILTERS + f] > best) {
+                    best = act->conv[t * CNN_FILTERS + f];
+                    best_t = t;
+                }
+            }
+            best += cnn->conv_biases[w][f];
+            act->pooled[w * CNN_FILTERS + f] = best > 0.0f ? best : 0.0f;
+            act->argmax[w * CNN_FILTERS + f] = best > 0.0f ? best_t : -1;
+            logit += act->pooled[w * CNN_FILTERS + f] * cnn->dense_weights[w * CNN_FILTERS + f];
+        }
+    }
+    return logit;
+}
+
+// Backward pass of one tweet with d(loss)/d(logit) = gradient, accumulated into grad. Only
+// the max-pooled position of each filter receives a gradient.
+void charCnnBackward(const CharCnn *cnn, const CharCnnActivations *act, float gradient, CharCnn *grad) {
+    grad->dense_bias += gradient;
+    for (int w = 0; w < CNN_NUM_WIDTHS; w++) {
+        int depth = cnn_widths[w] * CNN_EMBED;
+        for (int f = 0; f < CNN_FILTERS; f++) {
+            int j = w * CNN_FILTERS + f;
+            grad->dense_weights[j] += gradient * act->pooled[j];
+            int t = act->argmax[j];
+            if (t < 0) {
+                continue; // ReLU was inactive
+            }
+            float d = gradient * cnn->dense_weights[j];
+            grad->conv_biases[w][f] += d;
+            const float *window = act->inputs + t * CNN_EMBED;
+            for (int k = 0; k < depth; k++) {
+                grad->conv_weights[w][k][f] += window[k] * d;
+                grad->embedding[act->bytes[t + k / CNN_EMBED]][k % CNN_EMBED] += cnn->conv_weights[w][k][f] * d;
+            }
+        }
+    }
+}
+
+// Initialize the CNN with seeded Xavier/He weights, timed as one stage
+void charCnnInit(CharCnn *cnn, uint64_t seed) {
+    double start_time = wallSeconds(); // Start time measurement
+    memset(cnn, 0, sizeof(*cnn));
+    fillWeights(&cnn->embedding[0][0], CNN_EMBED, 256, seed + 1, INIT_XAVIER);
+    for (int w = 0; w < CNN_NUM_WIDTHS; w++) {
+        fillWeights(&cnn->conv_weights[w][0][0], cnn_widths[w] * CNN_EMBED, CNN_FILTERS, seed + 2 + w, INIT_HE);
+    }
+    fillWeights(cnn->dense_weights, CNN_NUM_WIDTHS * CNN_FILTERS, 1, seed + 2 + CNN_NUM_WIDTHS, INIT_XAVIER);
+    double end_time = wallSeconds(); // End time measurement
+    printf("CNN Weight Initialization Time: %.4f seconds\n", end_time - start_time);
+}
+
+// Scores (probabilities) of every tweet, parallel over the batch
+void charCnnPredict(const CharCnn *cnn, Post *dataset, int num_samples, float *outputs) {
+    #pragma omp parallel
+    {
+        CharCnnActivations *act = (CharCnnActivations *)safe_malloc(sizeof(CharCnnActivations), "activations");
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < num_samples; i++) {
+            outputs[i] = charCnnForward(cnn, dataset[i].text, act);
+        }
+        free(act);
+    }
+    sigmoidActivation(outputs, num_samples);
+}
+
+// Train with minibatch SGD on the logistic loss. Every minibatch is cut into
+// CNN_GRAD_SLICES fixed slices whose gradients are summed in a fixed order, so training
+// is reproducible for any thread count.
+void charCnnTrain(CharCnn *cnn, Post *dataset, const int *labels, int num_samples, int epochs) {
+    const int num_params = (int)(sizeof(CharCnn) / sizeof(float));
+    CharCnn *slice_grads = (CharCnn *)safe_malloc(CNN_GRAD_SLICES * sizeof(CharCnn), "slice_grads");
+    const int slice_size = CNN_BATCH / CNN_GRAD_SLICES;
+
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        double start_time = wallSeconds(); // Start time measurement
+        double loss = 0.0;
+        for (int b0 = 0; b0 < num_samples; b0 += CNN_BATCH) {
+            int batch = num_samples - b0 < CNN_BATCH ? num_samples - b0 : CNN_BATCH;
+            memset(slice_grads, 0, CNN_GRAD_SLICES * sizeof(CharCnn));
+            double slice_loss[CNN_GRAD_SLICES] = {0.0};
+            #pragma omp parallel
+            {
+                CharCnnActivations *act = (CharCnnActivations *)safe_malloc(sizeof(CharCnnActivations), "activations");
+                #pragma omp for schedule(static)
+                for (int slice = 0; slice < CNN_GRAD_SLICES; slice++) {
+                    for (int i = b0 + slice * slice_size; i < b0 + (slice + 1) * slice_size && i < b0 + batch; i++) {
+                        float p = 1.0f / (1.0f + expf(-charCnnForward(cnn, dataset[i].text, act)));
+                        float target = labels[i] == 4 ? 1.0f : 0.0f;
+                        float clipped = fminf(fmaxf(p, 1e-7f), 1.0f - 1e-7f);
+                        slice_loss[slice] -= target > 0.5f ? log((double)clipped) : log(1.0 - (double)clipped);
+                        charCnnBackward(cnn, act, p - target, &slice_grads[slice]);
+                    }
+                }
+                free(act);
+            }
+            // Fixed order sum of the slices, then the SGD step
+            float *params = (float *)cnn;
+            float scale = CNN_LEARNING_RATE / (float)batch;
+            #pragma omp parallel for schedule(static)
+            for (int p = 0; p < num_params; p++) {
+                float sum = 0.0f;
+                for (int slice = 0; slice < CNN_GRAD_SLICES; slice++) {
+                    sum += ((const float *)&slice_grads[slice])[p];
+                }
+                params[p] -= scale * sum;
+            }
+            loss += pairwiseSum(slice_loss, CNN_GRAD_SLICES);
+        }
+        double end_time = wallSeconds(); // End time measurement
+        double execution_time = end_time - start_time;
+        printf("CNN Epoch %d: loss %.4f, %.4f seconds (%.0f tweets/s)\n", epoch + 1, loss / num_samples,
+               execution_time, num_samples / execution_time);
+    }
+    free(slice_grads);
+}
+
+// Train the character CNN on the training split and report accuracy and throughput
+void runCharCnn(Post *trainSet, int *trainLabels, int trainSize, Post *testSet, int *testLabels, int testSize,
+                int epochs, uint64_t seed) {
+    printf("Running character CNN (%d epochs, widths", epochs);
+    for (int w = 0; w < CNN_NUM_WIDTHS; w++) {
+        printf(" %d", cnn_widths[w]);
+    }
+    printf(", %d filters each)...\n", CNN_FILTERS);
+
+    CharCnn *cnn = (CharCnn *)safe_malloc(sizeof(CharCnn), "cnn");
+    charCnnInit(cnn, seed);
+    charCnnTrain(cnn, trainSet, trainLabels, trainSize, epochs);
+
+    float *outputs = (float *)safe_malloc(testSize * sizeof(float), "cnnOutputs");
+    double start_time = wallSeconds(); // Start time measurement
+    charCnnPredict(cnn, testSet, testSize, outputs);
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
+    printf("CNN Inference Time: %.4f seconds (%.0f tweets/s)\n", execution_time, testSize / execution_time);
+    float accuracy = evaluate(outputs, testLabels, testSize);
+    printf("CNN Test set Accuracy: %.2f%%\n", accuracy * 100);
+
+    free(outputs);
+    free(cnn);
+}
+
+// Tweet counts of one user
+typedef struct {
+    const char *name; // In the dataset arena
+    int length;
+    int tweets;
+    int positive;
+} UserStats;
+
+// Analytics over a lazy column: the K users with the most tweets in the whole dataset and
+// the share of their tweets that are positive. Only the user column of each record is
+// read, straight from the dataset arena.
+void runTopUsers(const Post *trainSet, int trainSize, const Post *testSet, int testSize, int k) {
+    printf("Running top users (K = %d)...\n", k);
+    double start_time = wallSeconds(); // Start time measurement
+
+    int num_samples = trainSize + testSize;
+    int capacity = 1;
+    while (capacity < 2 * num_samples) {
+        capacity <<= 1;
+    }
+    int *slots = (int *)safe_malloc(capacity * sizeof(int), "userSlots"); // Index into users, or -1
+    memset(slots, 0xFF, capacity * sizeof(int));
+    UserStats *users = (UserStats *)safe_malloc((num_samples + 1) * sizeof(UserStats), "users");
+    int num_users = 0;
+
+    // Users are numbered in order of first appearance, so ties rank the same in every run
+    for (int i = 0; i < num_samples; i++) {
+        const Post *post = i < trainSize ? &trainSet[i] : &testSet[i - trainSize];
+        int length;
+        const char *name = postField(post, FIELD_USER, &length);
+        if (!name) {
+            printf("Error: The user column was not kept for this dataset.\n");
+            exit(1);
+        }
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (int c = 0; c < length; c++) {
+            hash = (hash ^ (uint8_t)name[c]) * 16777619u;
+        }
+        int slot = (int)(hash & (uint32_t)(capacity - 1));
+        while (slots[slot] >= 0 && (users[slots[slot]].length != length || memcmp(users[slots[slot]].name, name, length) != 0)) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (slots[slot] < 0) {
+            slots[slot] = num_users;
+            users[num_users].name = name;
+            users[num_users].length = length;
+            users[num_users].tweets = 0;
+            users[num_users].positive = 0;
+            num_users++;
+        }
+        users[slots[slot]].tweets++;
+        users[slots[slot]].positive += post->label == 4;
+    }
+
+    float *counts = (float *)safe_malloc((num_users + 1) * sizeof(float), "userCounts");
+    for (int u = 0; u < num_users; u++) {
+        counts[u] = (float)users[u].tweets;
+    }
+    if (k > num_users) {
+        k = num_users;
+    }
+    ScoredIndex *top = (ScoredIndex *)safe_malloc((k + 1) * sizeof(ScoredIndex), "topUsers");
+    int num_top = topKSelect(counts, num_users, k, TOPK_POSITIVE, top);
+    double execution_time = wallSeconds() - start_time;
+
+    printf("Distinct Users: %d in %d tweets\n", num_users, num_samples);
+    printf("%4s  %-20s %8s %10s\n", "rank", "user", "tweets", "positive");
+    for (int r = 0; r < num_top; r++) {
+        const UserStats *user = &users[top[r].index];
+        printf("%4d  %-20.*s %8d %9.1f%%\n", r + 1, user->length, user->name, user->tweets,
+               100.0 * user->positive / user->tweets);
+    }
+    printf("Top Users Time: %.4f seconds\n", execution_time);
+
+    free(slots);
+    free(users);
+    free(counts);
+    free(top);
+}
+
+// Per-document scores aggregated over windows
+typedef struct {
+    float mean;     // Mean window score
+    float max;      // Most positive window
+    float weighted; // Windows weighted by their distance from DECISION_THRESHOLD
+    int windows;
+} WindowedScore;
+
+// Number of windows of a text: starts every stride characters, with the last window
+// aligned to the end of the text so the tail is covered
+int countWindows(int length, int window, int stride) {
+    if (length <= window) {
+        return 1;
+    }
+    return (length - window + stride - 1) / stride + 1;
+}
+
+static inline StringView windowAt(StringView text, int w, int window, int stride) {
+    StringView view = text;
+    if (text.length > window) {
+        int start = w * stride;
+        start = start + window > text.length ? text.length - window : start;
+        view.data = text.data + start;
+        view.length = window;
+    }
+    return view;
+}
+
+// Score documents of any length with the dense model over overlapping windows of at most
+// feature_size characters. Windows are views into the documents; they are tokenized and
+// scored WINDOW_BATCH at a time, so memory stays bounded however long a document is.
+// Scores are accumulated in window order, so they do not depend on the thread count.
+void scoreWindowed(const StringView *documents, int num_documents, const float *weights, const float *biases,
+                   int window, int stride, WindowedScore *scores) {
+    float *token_ids = (float *)safe_aligned_malloc((size_t)WINDOW_BATCH * feature_size * sizeof(float), "windowTokenIds");
+    float *outputs = (float *)safe_malloc(WINDOW_BATCH * sizeof(float), "windowOutputs");
+    StringView *batch = (StringView *)safe_malloc(WINDOW_BATCH * sizeof(StringView), "windowBatch");
+    int *batch_document = (int *)safe_malloc(WINDOW_BATCH * sizeof(int), "windowDocuments");
+    double *sum = (double *)calloc(num_documents, sizeof(double));
+    double *weighted_sum = (double *)calloc(num_documents, sizeof(double));
+    double *weight_total = (double *)calloc(num_documents, sizeof(double));
+    if (!sum || !weighted_sum || !weight_total) {
+        printf("Error: Memory allocation failed for window sums.\n");
+        exit(1);
+    }
+    DenseKernel kernel = lookupDenseKernel(feature_size);
+    long long total_windows = 0;
+    for (int d = 0; d < num_documents; d++) {
+        scores[d].max = 0.0f;
+        scores[d].windows = countWindows(documents[d].length, window, stride);
+        total_windows += scores[d].windows;
+    }
+    metricsStage("windowed scoring", total_windows);
+
+    int document = 0, next_window = 0;
+    while (document < num_documents) {
+        // Fill a batch with the next windows, possibly spanning documents
+        double batch_start = wallSeconds();
+        int size = 0;
+        while (size < WINDOW_BATCH && document < num_documents) {
+            batch[size] = windowAt(documents[document], next_window, window, stride);
+            batch_document[size++] = document;
+            if (++next_window == scores[document].windows) {
+                document++;
+                next_window = 0;
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int b = 0; b < size; b++) {
+            embedRow(token_ids + (size_t)b * feature_size, batch[b].data, batch[b].length, 0);
+        }
+        kernel(token_ids, weights, biases[0], outputs, size, feature_size);
+
+        for (int b = 0; b < size; b++) {
+            int d = batch_document[b];
+            float p = 1.0f / (1.0f + expf(-outputs[b]));
+            float weight = fabsf(p - DECISION_THRESHOLD) + WINDOW_MIN_WEIGHT;
+            sum[d] += p;
+            weighted_sum[d] += (double)weight * p;
+            weight_total[d] += weight;
+            if (p > scores[d].max) {
+                scores[d].max = p;
+            }
+        }
+        metricAdd(METRIC_ROWS, size);
+        metricRecordSeconds(METRIC_BATCH_LATENCY, wallSeconds() - batch_start);
+    }
+
+    for (int d = 0; d < num_documents; d++) {
+        scores[d].mean = (float)(sum[d] / scores[d].windows);
+        scores[d].weighted = (float)(weighted_sum[d] / weight_total[d]);
+    }
+
+    free(token_ids);
+    free(outputs);
+    free(batch);
+    free(batch_document);
+    free(sum);
+    free(weighted_sum);
+    free(weight_total);
+}
+
+// Score the test set over windows and report the accuracy of each aggregation against
+// scoring the first feature_size characters only
+void runWindowed(const Post *testSet, const int *testLabels, const float *testOutputs, int testSize,
+                 const float *weights, const float *biases, int window, int stride) {
+    printf("Running windowed scoring (window %d, stride %d)...\n", window, stride);
+
+    StringView *documents = (StringView *)safe_malloc(testSize * sizeof(StringView), "windowDocuments");
+    for (int i = 0; i < testSize; i++) {
+        documents[i] = testSet[i].text;
+    }
+    WindowedScore *scores = (WindowedScore *)safe_malloc(testSize * sizeof(WindowedScore), "windowedScores");
+    double start_time = wallSeconds();
+    scoreWindowed(documents, testSize, weights, biases, window, stride, scores);
+    double execution_time = wallSeconds() - start_time;
+
+    long long total_windows = 0;
+    int split = 0;
+    int correct[4] = {0, 0, 0, 0};
+    for (int i = 0; i < testSize; i++) {
+        total_windows += scores[i].windows;
+        split += scores[i].windows > 1;
+        float values[4] = { testOutputs[i], scores[i].mean, scores[i].max, scores[i].weighted };
+        for (int a = 0; a < 4; a++) {
+            correct[a] += ((values[a] > DECISION_THRESHOLD ? 4 : 0) == testLabels[i]);
+        }
+    }
+    printf("Windows: %lld for %d documents (%d split into more than one)\n", total_windows, testSize, split);
+    const char *names[4] = { "First Window Only", "Mean", "Max", "Weighted" };
+    for (int a = 0; a < 4; a++) {
+        printf("Windowed Accuracy (%s): %.2f%%\n", names[a], 100.0 * correct[a] / testSize);
+    }
+    printf("Windowed Scoring Time: %.4f seconds (%.0f windows/s)\n", execution_time, total_windows / execution_time);
+
+    free(documents);
+    free(scores);
+}
+
+// Score every line of a text file (reviews, transcripts, ...) as one document of any length
+void scoreDocumentFile(const char *path, const float *weights, const float *biases, int window, int stride) {
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        printf("Error: Could not open file %s\n", path);
+        exit(1);
+    }
+    size_t size = (size_t)file_stat.st_size;
+    const char *data = NULL;
+    if (size > 0) {
+        data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("Error: Could not map file %s\n", path);
+            exit(1);
+        }
+    }
+    close(fd);
+
+    int num_documents = 0;
+    for (const char *line = data; line && line < data + size; num_documents++) {
+        const char *end = (const char *)memchr(line, '\n', data + size - line);
+        line = end ? end + 1 : data + size;
+    }
+    StringView *documents = (StringView *)safe_malloc((num_documents + 1) * sizeof(StringView), "documents");
+    const char *line = data;
+    for (int d = 0; d < num_documents; d++) {
+        const char *end = (const char *)memchr(line, '\n', data + size - line);
+        end = end ? end : data + size;
+        documents[d].data = line;
+        documents[d].length = (int)(end - line);
+        line = end + 1;
+    }
+
+    WindowedScore *scores = (WindowedScore *)safe_malloc((num_documents + 1) * sizeof(WindowedScore), "documentScores");
+    double start_time = wallSeconds();
+    scoreWindowed(documents, num_documents, weights, biases, window, stride, scores);
+    double execution_time = wallSeconds() - start_time;
+
+    printf("Scored %d documents from %s (window %d, stride %d)\n", num_documents, path, window, stride);
+    printf("%8s %10s %8s %8s %9s %9s\n", "document", "chars", "windows", "mean", "max", "weighted");
+    for (int d = 0; d < num_documents; d++) {
+        printf("%8d %10d %8d %8.4f %9.4f %9.4f\n", d, documents[d].length, scores[d].windows, scores[d].mean,
+               scores[d].max, scores[d].weighted);
+    }
+    printf("Document Scoring Time: %.4f seconds\n", execution_time);
+
+    free(documents);
+    free(scores);
+    if (data) {
+        munmap((void *)data, size);
+    }
+}
+
+// Print command line usage
+void printUsage(const char *program) {
+    printf("Usage: %s [dataset.csv] [options]\n", program);
+    printf("  --seed N           Seed for shuffling and weight initialization (default: current time)\n");
+    printf("  --init xavier|he   Weight initialization scheme (default: xavier)\n");
+    printf("  --threads N        Number of threads for the parallel loops (needs -fopenmp)\n");
+    printf("  --features N       Number of per-character features per tweet (default: %d)\n", NUM_FEATURES);
+    printf("  --hash-bits B      Table size 2^B of the hashed models (default: %d)\n", CASCADE_HASH_BITS);
+    printf("  --remap            Compare hashed scoring with weights in hash order and in training frequency order\n");
+    printf("  --bench-reduce     Benchmark deterministic against naive reductions and exit\n");
+    printf("  --bench-kernels    Benchmark specialized against generic scoring kernels and exit\n");
+    printf("  --bench-gather     Benchmark sparse scoring with prefetching and SIMD gathers and exit\n");
+    printf("  --nt-stores M      Streaming stores for large intermediate buffers: auto (larger than the\n");
+    printf("                     last-level cache), on or off (default: auto)\n");
+    printf("  --bench-stream     Benchmark tokenization with regular against streaming stores and exit\n");
+    printf("  --bench-loader     Compare time and peak memory of the prescan and realloc loaders and exit\n");
+    printf("  --cascade LOSS     Also score the test set with a cheap-model cascade tuned for at most\n");
+    printf("                     LOSS accuracy loss against the full model (e.g. 0.01)\n");
+    printf("  --cascade-band W   Escalate cheap scores within W of the threshold instead of tuning\n");
+    printf("  --ensemble N       Also score the test set with N stacked models sharing one tokenization\n");
+    printf("  --ensemble-out F   Write per-model, averaged and voted ensemble scores to CSV file F\n");
+    printf("  --explain K        Explain misclassified test tweets with their top K contributions\n");
+    printf("  --explain-out F    Write the explanations to CSV file F\n");
+    printf("  --topk K           Print the K most positive, most negative and most uncertain test tweets\n");
+    printf("  --knn K            Classify the test set by the K nearest training tweets (HNSW index)\n");
+    printf("  --knn-ef EF        Beam width of kNN searches (default: 64)\n");
+    printf("  --knn-index F      Map the kNN index from file F, or build it and save it there\n");
+    printf("  --pq K             Retrieve the K nearest training tweets from product-quantized embeddings\n");
+    printf("  --simhash R        Cluster tweets whose SimHash signatures are within R (0-3) bits\n");
+    printf("  --cnn EPOCHS       Train and evaluate the character CNN for EPOCHS epochs\n");
+    printf("  --windows W        Also score the test set over overlapping windows of W characters\n");
+    printf("  --window-stride S  Characters between window starts (default: W / 2)\n");
+    printf("  --score-docs F     Score every line of text file F as one document, over windows\n");
+    printf("  --feature-store N  Share the token matrices through shared memory segment N (a file if N has a '/')\n");
+    printf("  --feature-store-remove  Remove the feature store when the last process using it exits\n");
+    printf("  --spill-epochs E   Train the hashed model for E epochs from tokenized chunks spilled to disk\n");
+    printf("  --spill-dir DIR    Directory of the spill file (default: /tmp)\n");
+    printf("  --metrics FILE     Rewrite FILE with live metrics in the Prometheus text format\n");
+    printf("  --metrics-interval S  Seconds between metrics file updates (default: 1)\n");
+    printf("  --latency          Score test tweets one at a time and print latency percentiles\n");
+    printf("  --bench-roofline   Measure FLOP and bandwidth ceilings and place the scoring kernels under them, then exit\n");
+    printf("  --bench-scaling    Benchmark strong and weak scaling of the pipeline stages and exit\n");
+    printf("  --scaling-sizes L  Tweet counts of the scaling benchmark (default: 10K,100K,1M)\n");
+    printf("  --scaling-threads L  Thread counts of the scaling benchmark (default: 1, 2, 4, ... up to --threads)\n");
+    printf("  --scaling-repeats R  Runs per scaling configuration, best kept (default: 3)\n");
+    printf("  --bench-histogram  Benchmark latency histogram recording and exit\n");
+    printf("  --energy           Print the RAPL energy of each stage under its time\n");
+    printf("  --tweet TEXT       Score one tweet with the model after evaluation\n");
+    printf("  --top-users K      Print the K users with the most tweets and their share of positive tweets\n");
+}
+
+// Benchmark the deterministic reductions against naive ones and check that their
+// results are bit-identical for 1..max threads
+void benchmarkReductions(uint64_t seed) {
+    const long long n = 1LL << 24;
+    const int repeats = 5;
+    float *values = (float *)safe_malloc(n * sizeof(float), "values");
+    float *other = (float *)safe_malloc(n * sizeof(float), "other");
+
+    // Values with mixed signs and magnitudes, where summation order matters
+    #pragma omp parallel for schedule(static)
+    for (long long i = 0; i < n; i++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_BENCH, (uint64_t)i, r);
+        values[i] = (philoxUniform(r[0]) - 0.5f) * ldexpf(1.0f, (int)(r[1] % 24) - 12);
+        other[i] = philoxUniform(r[2]) - 0.5f;
+    }
+
+    int max_threads = maxThreads();
+    double reference_sum = 0.0, reference_dot = 0.0;
+    int identical = 1;
+    printf("Reduction benchmark over %lld floats (%d repeats)\n", n, repeats);
+    printf("%8s %14s %14s %14s %14s\n", "threads", "naive (s)", "omp (s)", "pairwise (s)", "overhead");
+    for (int t = 1; t <= max_threads; t++) {
+        setThreads(t);
+        double naive_time = 0.0, omp_time = 0.0, pairwise_time = 0.0;
+        float naive_sum = 0.0f, omp_sum = 0.0f;
+        double sum = 0.0, dot = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            double start = wallSeconds();
+            naive_sum = 0.0f;
+            for (long long i = 0; i < n; i++) {
+                naive_sum += values[i];
+            }
+            naive_time += wallSeconds() - start;
+
+            start = wallSeconds();
+            float partial = 0.0f;
+            #pragma omp parallel for schedule(static) reduction(+:partial)
+            for (long long i = 0; i < n; i++) {
+                partial += values[i];
+            }
+            omp_sum = partial;
+            omp_time += wallSeconds() - start;
+
+            start = wallSeconds();
+            sum = deterministicSum(values, n);
+            pairwise_time += wallSeconds() - start;
+        }
+        dot = deterministicDot(values, other, n);
+        if (t == 1) {
+            reference_sum = sum;
+            reference_dot = dot;
+        } else if (memcmp(&sum, &reference_sum, sizeof(double)) != 0 || memcmp(&dot, &reference_dot, sizeof(double)) != 0) {
+            identical = 0;
+        }
+        printf("%8d %14.4f %14.4f %14.4f %13.2fx   (naive %.9g, omp %.9g, pairwise %.17g)\n", t,
+               naive_time / repeats, omp_time / repeats, pairwise_time / repeats,
+               pairwise_time / omp_time, naive_sum, omp_sum, sum);
+    }
+    printf("Deterministic results bit-identical across 1..%d threads: %s\n", max_threads, identical ? "yes" : "NO");
+
+    setThreads(max_threads);
+    free(values);
+    free(other);
+}
+
+// Benchmark every registered specialized kernel against the generic kernel for the same
+// size on synthetic data, and check that both give bit-identical scores
+void benchmarkKernels(uint64_t seed) {
+    const long long floats = 1LL << 24;
+    const int repeats = 5;
+    float *inputs = (float *)safe_malloc(floats * sizeof(float), "benchInputs");
+    float *weights = (float *)safe_malloc(4096 * sizeof(float), "benchWeights");
+    float *specialized = (float *)safe_malloc((floats / 256) * sizeof(float), "specializedOutputs");
+    float *generic = (float *)safe_malloc((floats / 256) * sizeof(float), "genericOutputs");
+
+    #pragma omp parallel for schedule(static)
+    for (long long i = 0; i < floats; i++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_BENCH, (uint64_t)i, r);
+        inputs[i] = philoxUniform(r[0]);
+    }
+    init_weights(weights, 4096, 1, seed, INIT_XAVIER);
+
+    int identical = 1;
+    printf("Kernel benchmark (%d repeats, %d threads)\n", repeats, maxThreads());
+    printf("%-14s %10s %16s %16s %10s\n", "kernel", "samples", "specialized (s)", "generic (s)", "speedup");
+    for (size_t e = 0; e < sizeof(dense_kernels) / sizeof(dense_kernels[0]); e++) {
+        int size = dense_kernels[e].size;
+        int num_samples = (int)(floats / size);
+        double specialized_time = 0.0, generic_time = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            double start = wallSeconds();
+            dense_kernels[e].kernel(inputs, weights, 0.0f, specialized, num_samples, size);
+            specialized_time += wallSeconds() - start;
+            start = wallSeconds();
+            denseKernelGeneric(inputs, weights, 0.0f, generic, num_samples, size);
+            generic_time += wallSeconds() - start;
+        }
+        identical &= memcmp(specialized, generic, num_samples * sizeof(float)) == 0;
+        printf("dense %-8d %10d %16.5f %16.5f %9.2fx\n", size, num_samples, specialized_time / repeats,
+               generic_time / repeats, generic_time / specialized_time);
+    }
+
+    // Hashed features: 16 random 32-bit ids per tweet, scored against random tables
+    const int hashed_samples = 1 << 20, ids_per_sample = 16;
+    HashedFeatures features;
+    features.num_samples = hashed_samples;
+    features.offsets = (long long *)safe_malloc((hashed_samples + 1) * sizeof(long long), "benchOffsets");
+    features.ids = (uint32_t *)safe_malloc((size_t)hashed_samples * ids_per_sample * sizeof(uint32_t), "benchIds");
+    for (int i = 0; i <= hashed_samples; i++) {
+        features.offsets[i] = (long long)i * ids_per_sample;
     }
-    return length;
+    #pragma omp parallel for schedule(static)
+    for (long long i = 0; i < (long long)hashed_samples * ids_per_sample / 4; i++) {
+        philoxBlock(seed, STREAM_BENCH, (uint64_t)(floats + i), features.ids + i * 4);
+    }
+    float *hashed_specialized = (float *)safe_malloc(hashed_samples * sizeof(float), "hashedSpecialized");
+    float *hashed_generic = (float *)safe_malloc(hashed_samples * sizeof(float), "hashedGeneric");
+    for (size_t e = 0; e < sizeof(hashed_kernels) / sizeof(hashed_kernels[0]); e++) {
+        HashedLinearModel model = { hashed_kernels[e].hash_bits, NULL, 0.0f };
+        size_t table_size = (size_t)1 << model.hash_bits;
+        model.weights = (float *)safe_malloc(table_size * sizeof(float), "benchTable");
+        for (size_t k = 0; k < table_size; k++) {
+            model.weights[k] = inputs[k % floats] - 0.5f;
+        }
+        double specialized_time = 0.0, generic_time = 0.0;
+        for (int r = 0; r < repeats; r++) {
+            double start = wallSeconds();
+            hashed_kernels[e].kernel(&model, &features, hashed_specialized);
+            specialized_time += wallSeconds() - start;
+            start = wallSeconds();
+            hashedKernelGeneric(&model, &features, hashed_generic);
+            generic_time += wallSeconds() - start;
+        }
+        identical &= memcmp(hashed_specialized, hashed_generic, hashed_samples * sizeof(float)) == 0;
+        printf("hashed 2^%-5d %10d %16.5f %16.5f %9.2fx\n", model.hash_bits, hashed_samples,
+               specialized_time / repeats, generic_time / repeats, generic_time / specialized_time);
+        free(model.weights);
+    }
+    printf("Specialized and generic scores bit-identical: %s\n", identical ? "yes" : "NO");
+
+    freeHashedFeatures(&features);
+    free(hashed_specialized);
+    free(hashed_generic);
+    free(inputs);
+    free(weights);
+    free(specialized);
+    free(generic);
 }
 
-// Helper: Allocate memory and handle failure
-void *safe_malloc(size_t size, const char *name) {
-    void *ptr = malloc(size);
-    if (!ptr) {
-        printf("Error: Memory allocation failed for %s.\n", name);
-        exit(1);
+// qsort comparator for ascending long long values
+int compareLongLong(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Cost of one histogram record, on one thread and on all threads at once, for latencies
+// spread log-uniformly from 10 ns to 10 ms
+void benchmarkHistogram(uint64_t seed) {
+    const int n = 1 << 22;
+    const int repeats = 5;
+    long long *values = (long long *)safe_malloc(n * sizeof(long long), "histogramValues");
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_BENCH, (uint64_t)i, r);
+        values[i] = (long long)(10.0 * pow(1e6, philoxUniform(r[0])));
     }
-    return ptr;
+    HdrHistogram histogram;
+    hdrInit(&histogram);
+
+    printf("%-12s %8s %14s\n", "threads", "repeats", "ns per record");
+    int thread_counts[2] = { 1, maxThreads() };
+    for (int c = 0; c < (thread_counts[1] > 1 ? 2 : 1); c++) {
+        int threads = thread_counts[c];
+        double best = 1e30;
+        for (int r = 0; r < repeats; r++) {
+            double start = wallSeconds();
+            #pragma omp parallel for schedule(static) num_threads(threads)
+            for (int i = 0; i < n; i++) {
+                hdrRecord(&histogram, values[i]);
+            }
+            double elapsed = wallSeconds() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        printf("%-12d %8d %14.2f\n", threads, repeats, best * 1e9 * threads / n);
+    }
+
+    static HdrSnapshot snapshot;
+    hdrSnapshot(&histogram, &snapshot);
+    printLatencySummary("Recorded Values", &snapshot);
+    long long exact[4];
+    double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+    long long *sorted = (long long *)safe_malloc(n * sizeof(long long), "sortedValues");
+    memcpy(sorted, values, n * sizeof(long long));
+    qsort(sorted, n, sizeof(long long), compareLongLong);
+    double worst = 0.0;
+    for (int q = 0; q < 4; q++) {
+        exact[q] = sorted[(long long)ceil(quantiles[q] * n) - 1];
+        double error = fabs((double)hdrQuantile(&snapshot, quantiles[q]) - exact[q]) / exact[q];
+        worst = error > worst ? error : worst;
+    }
+    printf("Largest Quantile Error: %.2f%% (p50 %lld ns, p99.9 %lld ns exact)\n", worst * 100, exact[0], exact[3]);
+
+    free(sorted);
+    free(values);
+    hdrFree(&histogram);
 }
 
-// Shuffle the dataset to randomize it
-void shuffleDataset(Post *dataset, int num_samples) {
-    srand(time(NULL));  // Seed for randomness
+// Tweets of 20..147 random lowercase letters and spaces with random labels, drawn from the
+// benchmark stream starting at counter base; *texts receives the buffer they point into
+Post *syntheticPosts(uint64_t seed, uint64_t base, int num_samples, char **texts) {
+    Post *posts = (Post *)safe_malloc((num_samples + 1) * sizeof(Post), "benchPosts");
+    char *buffer = (char *)safe_malloc((size_t)num_samples * 148 + 1, "benchTexts");
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < num_samples; i++) {
-        int j = rand() % num_samples;
-        // Swap elements
-        Post temp = dataset[i];
-        dataset[i] = dataset[j];
-        dataset[j] = temp;
+        uint32_t r[4];
+        philoxBlock(seed, STREAM_BENCH, base + ((uint64_t)i << 8), r);
+        int length = 20 + (int)(r[0] & 127);
+        posts[i].label = (r[1] & 1) ? 4 : 0;
+        for (int j = 0; j < length; j++) {
+            if ((j & 3) == 0) {
+                philoxBlock(seed, STREAM_BENCH, base + ((uint64_t)i << 8) + 1 + (j >> 2), r);
+            }
+            uint32_t letter = r[j & 3] % 28;
+            buffer[(size_t)i * 148 + j] = letter >= 26 ? ' ' : (char)('a' + letter);
+        }
+        posts[i].text.data = buffer + (size_t)i * 148;
+        posts[i].text.length = length;
+        posts[i].record = -1;
     }
+    *texts = buffer;
+    return posts;
 }
 
-// Load dataset from file
-int loadDataset(const char *filename, Post **dataset) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: Could not open file %s\n", filename);
-        exit(1);
+static const char *scaling_stage_names[NUM_SCALING_STAGES] = { "tokenize", "dense", "sigmoid", "hashed" };
+
+// Parse a comma-separated list of counts with optional K and M suffixes ("10K,1M")
+int parseCountList(const char *text, long long *values, int max_values) {
+    int count = 0;
+    while (*text && count < max_values) {
+        char *end;
+        double value = strtod(text, &end);
+        if (end == text || value < 1) {
+            return 0;
+        }
+        if (*end == 'k' || *end == 'K') {
+            value *= 1e3;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            value *= 1e6;
+            end++;
+        }
+        if (*end != ',' && *end != '\0') {
+            return 0;
+        }
+        values[count++] = (long long)value;
+        text = *end == ',' ? end + 1 : end;
     }
+    return count;
+}
 
-    size_t capacity = 1000;
-    size_t count = 0;
-    *dataset = (Post *)safe_malloc(capacity * sizeof(Post), "dataset");
+// Seconds each stage takes on n tweets drawn (with replacement) from the pool, with the
+// current thread count. Rows go through one block-sized matrix, so any n fits in memory.
+static void timeScalingStages(const Post *pool, int pool_size, long long n, uint64_t seed, const float *weights,
+                              float *matrix, Post *block, float *outputs, double *seconds) {
+    for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+        seconds[stage] = 0.0;
+    }
+    DenseKernel kernel = lookupDenseKernel(feature_size);
+    long long correct = 0, tokens = 0;
+    for (long long first = 0; first < n; first += SCALING_BLOCK) {
+        int rows = (int)(n - first < SCALING_BLOCK ? n - first : SCALING_BLOCK);
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < rows; i++) {
+            uint32_t r[4];
+            philoxBlock(seed, STREAM_BENCH, (uint64_t)(first + i), r);
+            block[i] = pool[r[0] % (uint32_t)pool_size];
+        }
 
-    char line[1024];
-    while (fgets(line, sizeof(line), file)) {
-        if (count >= capacity) {
-            capacity *= 2;
-            *dataset = (Post *)realloc(*dataset, capacity * sizeof(Post));
-            if (!*dataset) {
-                printf("Error: Memory reallocation failed.\n");
-                fclose(file);
-                exit(1);
+        double start = wallSeconds();
+        int streaming = useStreamingStores(matrix, (size_t)rows * feature_size * sizeof(float),
+                                           (feature_size * sizeof(float)) % CACHE_LINE == 0);
+        #pragma omp parallel
+        {
+            #pragma omp for schedule(dynamic, TOKENIZE_BATCH) nowait
+            for (int i = 0; i < rows; i++) {
+                embedRow(matrix + (size_t)i * feature_size, block[i].text.data, block[i].text.length, streaming);
             }
+            streamingStoreFence(streaming);
         }
+        seconds[0] += wallSeconds() - start;
 
-        // Read label (first column of dataset)
-        char *token = strtok(line, ",");
-        if (!token) continue;
-
-        (*dataset)[count].label = atoi(token);  // Use numeric labels (0 for negative, 4 for positive)
+        start = wallSeconds();
+        kernel(matrix, weights, 0.0f, outputs, rows, feature_size);
+        seconds[1] += wallSeconds() - start;
 
-        // Skip unnecessary columns (3rd, 4th, and 5th columns)
-        token = strtok(NULL, ",");
-        for (int i = 0; i < 3; i++) {
-            token = strtok(NULL, ",");
+        start = wallSeconds();
+        #pragma omp parallel for schedule(static) reduction(+:correct)
+        for (int i = 0; i < rows; i++) {
+            outputs[i] = 1.0f / (1.0f + expf(-outputs[i]));
+            correct += ((outputs[i] > DECISION_THRESHOLD ? 4 : 0) == block[i].label);
         }
+        seconds[2] += wallSeconds() - start;
 
-        // Read the tweet content (last column)
-        token = strtok(NULL, "\n");
-        if (token) {
-            strncpy((*dataset)[count].text, token, MAX_TOKENS - 1);
-            (*dataset)[count].text[MAX_TOKENS - 1] = '\0';
-            count++;
+        start = wallSeconds();
+        uint32_t scratch[MAX_TOKENS];
+        #pragma omp parallel for schedule(dynamic, TOKENIZE_BATCH) private(scratch) reduction(+:tokens)
+        for (int i = 0; i < rows; i++) {
+            tokens += hashTokens(block[i].text, scratch, MAX_TOKENS);
         }
+        seconds[3] += wallSeconds() - start;
     }
+    if (correct < 0 || tokens < 0) { // Keeps the work from being optimized away
+        printf("Unexpected counts\n");
+    }
+}
 
-    fclose(file);
-    return count;
+static double sumStages(const double *seconds) {
+    double total = 0.0;
+    for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+        total += seconds[stage];
+    }
+    return total;
 }
 
-// Load and split the dataset into training and testing
-int loadAndSplitDataset(const char *filename, Post **trainSet, Post **testSet, int *trainSize, int *testSize) {
-    clock_t start_time = clock(); // Start time measurement
-    Post *dataset = NULL;
-    int num_samples = loadDataset(filename, &dataset);  // Load entire dataset
+// The stage that loses the most time against its ideal (the baseline time for weak
+// scaling, or the one-thread time over the thread count for strong scaling)
+static int limitingStage(const double *seconds, const double *ideal, double *excess) {
+    int worst = 0;
+    *excess = -1e30;
+    for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+        if (seconds[stage] - ideal[stage] > *excess) {
+            *excess = seconds[stage] - ideal[stage];
+            worst = stage;
+        }
+    }
+    return worst;
+}
 
-    // Shuffle the dataset to randomize the order
-    shuffleDataset(dataset, num_samples);
+// Strong scaling (fixed sizes over thread counts) and weak scaling (the first size per
+// thread) of the pipeline stages, best of several repeats per configuration
+void benchmarkScaling(const char *dataset_path, uint64_t seed, const char *size_list, const char *thread_list, int repeats) {
+    long long sizes[MAX_SCALING_POINTS], threads[MAX_SCALING_POINTS];
+    int num_sizes = parseCountList(size_list, sizes, MAX_SCALING_POINTS);
+    int num_threads = 0;
+    int max_threads = maxThreads();
+    if (thread_list) {
+        num_threads = parseCountList(thread_list, threads, MAX_SCALING_POINTS);
+    } else {
+        for (int t = 1; t < max_threads && num_threads < MAX_SCALING_POINTS - 1; t *= 2) {
+            threads[num_threads++] = t;
+        }
+        threads[num_threads++] = max_threads;
+    }
+    if (num_sizes == 0 || num_threads == 0) {
+        printf("Error: --scaling-sizes and --scaling-threads need lists like 10K,100K,1M\n");
+        exit(1);
+    }
 
-    // Split into 70% training and 30% testing
-    *trainSize = (int)(num_samples * 0.7);
-    *testSize = num_samples - *trainSize;
+    // Tweets are sampled from the dataset, or from synthetic tweets if it cannot be read
+    Post *pool = NULL, *trainSet = NULL, *testSet = NULL;
+    int pool_size = 0;
+    char *texts = NULL;
+    if (access(dataset_path, R_OK) == 0) {
+        int trainSize, testSize;
+        loadAndSplitDataset(dataset_path, &trainSet, &testSet, &trainSize, &testSize, seed);
+        pool_size = trainSize + testSize;
+        pool = (Post *)safe_malloc((pool_size + 1) * sizeof(Post), "scalingPool");
+        memcpy(pool, trainSet, trainSize * sizeof(Post));
+        memcpy(pool + trainSize, testSet, testSize * sizeof(Post));
+        printf("Scaling benchmark on tweets sampled from %s (%d tweets)\n", dataset_path, pool_size);
+    }
+    if (pool_size == 0) {
+        pool_size = SCALING_POOL;
+        pool = syntheticPosts(seed, (uint64_t)1 << 40, pool_size, &texts);
+        printf("Scaling benchmark on synthetic tweets (%s not readable)\n", dataset_path);
+    }
+    printf("Threads:");
+    for (int t = 0; t < num_threads; t++) {
+        printf(" %lld", threads[t]);
+    }
+#ifdef _OPENMP
+    printf(" (%d cores available)", omp_get_num_procs());
+#endif
+    printf(", best of %d repeats per configuration\n", repeats);
 
-    // Allocate memory for the training and testing sets
-    *trainSet = (Post *)safe_malloc(*trainSize * sizeof(Post), "trainSet");
-    *testSet = (Post *)safe_malloc(*testSize * sizeof(Post), "testSet");
+    float *weights = (float *)safe_malloc((size_t)feature_size * sizeof(float), "scalingWeights");
+    init_weights(weights, feature_size, 1, seed, INIT_XAVIER);
+    float *matrix = (float *)safe_aligned_malloc((size_t)SCALING_BLOCK * feature_size * sizeof(float), "scalingMatrix");
+    Post *block = (Post *)safe_malloc(SCALING_BLOCK * sizeof(Post), "scalingBlock");
+    float *outputs = (float *)safe_malloc(SCALING_BLOCK * sizeof(float), "scalingOutputs");
+    // Fault the pages in before timing, so the first configuration does not pay for them
+    memset(matrix, 0, (size_t)SCALING_BLOCK * feature_size * sizeof(float));
+    memset(block, 0, SCALING_BLOCK * sizeof(Post));
+    memset(outputs, 0, SCALING_BLOCK * sizeof(float));
 
-    // Copy the data into the train and test sets
-    for (int i = 0; i < *trainSize; i++) {
-        (*trainSet)[i] = dataset[i];
+    // Best stage times for (threads, size); weak scaling adds sizes[0] x threads
+    static double strong[MAX_SCALING_POINTS][MAX_SCALING_POINTS][NUM_SCALING_STAGES];
+    static double weak[MAX_SCALING_POINTS][NUM_SCALING_STAGES];
+    for (int t = 0; t < num_threads; t++) {
+        setThreads((int)threads[t]);
+        for (int z = 0; z <= num_sizes; z++) {
+            long long n = z < num_sizes ? sizes[z] : sizes[0] * threads[t];
+            double *best = z < num_sizes ? strong[t][z] : weak[t];
+            for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+                best[stage] = 1e30;
+            }
+            for (int r = 0; r < repeats; r++) {
+                double seconds[NUM_SCALING_STAGES];
+                timeScalingStages(pool, pool_size, n, seed, weights, matrix, block, outputs, seconds);
+                for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+                    best[stage] = seconds[stage] < best[stage] ? seconds[stage] : best[stage];
+                }
+            }
+        }
     }
-    for (int i = 0; i < *testSize; i++) {
-        (*testSet)[i] = dataset[*trainSize + i];
+    setThreads(max_threads);
+
+    for (int z = 0; z < num_sizes; z++) {
+        printf("\nStrong scaling, %lld tweets (seconds):\n", sizes[z]);
+        printf("%8s", "threads");
+        for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+            printf(" %10s", scaling_stage_names[stage]);
+        }
+        printf(" %10s %8s %10s  %s\n", "total", "speedup", "efficiency", "limiting stage");
+        double base_total = sumStages(strong[0][z]);
+        for (int t = 0; t < num_threads; t++) {
+            double scale = (double)threads[t] / (double)threads[0];
+            double total = sumStages(strong[t][z]);
+            double ideal[NUM_SCALING_STAGES], excess;
+            for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+                ideal[stage] = strong[0][z][stage] / scale;
+            }
+            int limit = limitingStage(strong[t][z], ideal, &excess);
+            printf("%8lld", threads[t]);
+            for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+                printf(" %10.4f", strong[t][z][stage]);
+            }
+            printf(" %10.4f %7.2fx %9.1f%%", total, base_total / total, 100.0 * base_total / (total * scale));
+            if (t > 0) {
+                printf("  %s (%.1f%% efficient, %.4f s over ideal)", scaling_stage_names[limit],
+                       100.0 * ideal[limit] / strong[t][z][limit], excess);
+            }
+            printf("\n");
+        }
     }
 
-    free(dataset);  // Free the original dataset after splitting
-    clock_t end_time = clock(); // End time measurement
-    double execution_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
-    printf("Loading and Splitting Time: %.4f seconds\n", execution_time);
+    printf("\nWeak scaling, %lld tweets per thread (seconds):\n", sizes[0]);
+    printf("%8s %12s", "threads", "tweets");
+    for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+        printf(" %10s", scaling_stage_names[stage]);
+    }
+    printf(" %10s %10s  %s\n", "total", "efficiency", "limiting stage");
+    double base_total = sumStages(weak[0]);
+    for (int t = 0; t < num_threads; t++) {
+        double total = sumStages(weak[t]);
+        double excess;
+        int limit = limitingStage(weak[t], weak[0], &excess);
+        printf("%8lld %12lld", threads[t], sizes[0] * threads[t]);
+        for (int stage = 0; stage < NUM_SCALING_STAGES; stage++) {
+            printf(" %10.4f", weak[t][stage]);
+        }
+        printf(" %10.4f %9.1f%%", total, 100.0 * base_total / total);
+        if (t > 0) {
+            printf("  %s (%.1f%% efficient, %.4f s over ideal)", scaling_stage_names[limit],
+                   100.0 * weak[0][limit] / weak[t][limit], excess);
+        }
+        printf("\n");
+    }
 
-    return num_samples;
+    free(weights);
+    free(matrix);
+    free(block);
+    free(outputs);
+    free(pool);
+    free(texts);
+    free(trainSet);
+    free(testSet);
+    freeDatasetArena();
 }
 
-// Modified tokenization using hash function (previously used ASCII values)
-void tokenizeAndEmbed(Post *dataset, float *token_ids, int num_samples) {
-    clock_t start_time = clock(); // Start time measurement
+// Benchmark tokenization into a token matrix twice the cache size (256 MB to 1 GB) with
+// regular and with streaming stores, on synthetic tweets
+void benchmarkStreamingStores(uint64_t seed) {
+    size_t target_bytes = 2 * llcBytes();
+    target_bytes = target_bytes < ((size_t)256 << 20) ? (size_t)256 << 20 : target_bytes;
+    target_bytes = target_bytes > ((size_t)1 << 30) ? (size_t)1 << 30 : target_bytes;
+    size_t row_bytes = (size_t)feature_size * sizeof(float);
+    int num_samples = (int)(target_bytes / row_bytes);
+    size_t matrix_bytes = (size_t)num_samples * row_bytes;
 
-    for (int i = 0; i < num_samples; i++) {
-        for (int j = 0; j < custom_strlen(dataset[i].text); j++) {
-            token_ids[i * MAX_TOKENS + j] = (float)(dataset[i].text[j]) / 255.0f;
+    char *texts;
+    Post *posts = syntheticPosts(seed, 0, num_samples, &texts);
+
+    float *regular = (float *)safe_aligned_malloc(matrix_bytes, "regularTokenIds");
+    float *streamed = (float *)safe_aligned_malloc(matrix_bytes, "streamedTokenIds");
+    memset(regular, 0, matrix_bytes); // Fault the pages in before timing
+    memset(streamed, 0, matrix_bytes);
+
+    // Store misses in the LLC are the lines read for ownership before being written
+    LlcMissCounter counter;
+    llcCounterOpen(&counter, 1);
+    NonTemporalMode saved_mode = non_temporal_mode;
+    double times[2] = { 0.0, 0.0 };
+    long long misses[2] = { 0, 0 };
+    for (int r = 0; r < STREAM_BENCH_REPEATS; r++) {
+        for (int m = 0; m < 2; m++) {
+            non_temporal_mode = m == 0 ? NT_NEVER : NT_ALWAYS;
+            llcCounterStart(&counter);
+            double start = wallSeconds();
+            tokenizeAndEmbed(posts, m == 0 ? regular : streamed, num_samples, NULL);
+            double elapsed = wallSeconds() - start;
+            long long pass_misses = llcCounterStop(&counter);
+            misses[m] = pass_misses < 0 || misses[m] < 0 ? -1 : misses[m] + pass_misses;
+            times[m] = r == 0 || elapsed < times[m] ? elapsed : times[m];
         }
     }
+    non_temporal_mode = saved_mode;
+    llcCounterClose(&counter);
 
-    clock_t end_time = clock(); // End time measurement
-    double execution_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
-    printf("Tokenization Time: %.4f seconds\n", execution_time);
+    // Estimated traffic: regular stores read each line for ownership before writing it
+    // back, so they move about twice the bytes of streaming stores. The measured figure
+    // is the read-for-ownership part alone, which streaming stores should remove.
+    printf("Streaming store benchmark: %d tweets, %.1f MB token matrix, %.1f MB last-level cache\n",
+           num_samples, matrix_bytes / 1e6, llcBytes() / 1e6);
+    printf("Regular Stores: %.4f seconds, %.2f GB/s written (estimated %.1f MB memory traffic)\n",
+           times[0], matrix_bytes / times[0] / 1e9, 2.0 * matrix_bytes / 1e6);
+    printf("Streaming Stores: %.4f seconds, %.2f GB/s written (estimated %.1f MB memory traffic, %.2fx)\n",
+           times[1], matrix_bytes / times[1] / 1e9, matrix_bytes / 1e6, times[0] / times[1]);
+    for (int m = 0; m < 2; m++) {
+        const char *label = m == 0 ? "Regular Stores" : "Streaming Stores";
+        if (misses[m] < 0) {
+            printf("%s Read For Ownership: unavailable (no perf_event access)\n", label);
+        } else {
+            printf("%s Read For Ownership: %.1f MB measured per pass (%lld LLC store misses)\n", label,
+                   (double)misses[m] / STREAM_BENCH_REPEATS * CACHE_LINE / 1e6, misses[m] / STREAM_BENCH_REPEATS);
+        }
+    }
+    printf("Token Matrices Identical: %s\n", memcmp(regular, streamed, matrix_bytes) == 0 ? "yes" : "NO");
+
+    free(posts);
+    free(texts);
+    free(regular);
+    free(streamed);
 }
 
-// Random weight initialization using Xavier method
-void init_weights(float *weights, int num_features) {
-    for (int i = 0; i < num_features * num_features; i++) {
-        weights[i] = ((float)rand() / RAND_MAX) * sqrt(2.0f / num_features); // Xavier initialization
+// Peak FLOP kernels: ROOFLINE_CHAINS independent multiply-add chains per thread, so the
+// loop is bound by arithmetic throughput. The chains are named locals rather than an array,
+// which GCC keeps in memory at -O2 and then measures store forwarding instead of the FMA
+// units. Starting values differ so the chains cannot be merged. Each returns a sum so the
+// work is kept.
+#define ROOFLINE_FOR_CHAINS(STEP) \
+    STEP(a0) STEP(a1) STEP(a2) STEP(a3) STEP(a4) STEP(a5) STEP(a6) STEP(a7) STEP(a8) STEP(a9) STEP(a10) STEP(a11)
+#define ROOFLINE_START(SET) \
+    a0 = SET(1.000f), a1 = SET(1.001f), a2 = SET(1.002f), a3 = SET(1.003f), a4 = SET(1.004f), a5 = SET(1.005f), \
+    a6 = SET(1.006f), a7 = SET(1.007f), a8 = SET(1.008f), a9 = SET(1.009f), a10 = SET(1.010f), a11 = SET(1.011f)
+#define ROOFLINE_SCALAR(x) (x)
+
+static float flopPeakBaseline(long long iterations) {
+    float ROOFLINE_START(ROOFLINE_SCALAR);
+    const float m = 0.999999f, d = 1e-7f;
+#define BASELINE_STEP(acc) acc = acc * m + d;
+    for (long long it = 0; it < iterations; it++) {
+        ROOFLINE_FOR_CHAINS(BASELINE_STEP)
     }
+#undef BASELINE_STEP
+    return a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 + a8 + a9 + a10 + a11;
 }
 
-// Dense layer computation
-void denseLayer(float *inputs, float *weights, float *biases, float *outputs, int num_samples, int embedding_size) {
-    clock_t start_time = clock(); // Start time measurement
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2,fma"))) static float flopPeakAvx2(long long iterations) {
+    __m256 ROOFLINE_START(_mm256_set1_ps);
+    const __m256 m = _mm256_set1_ps(0.999999f), d = _mm256_set1_ps(1e-7f);
+#define AVX2_STEP(acc) acc = _mm256_fmadd_ps(acc, m, d);
+    for (long long it = 0; it < iterations; it++) {
+        ROOFLINE_FOR_CHAINS(AVX2_STEP)
+    }
+#undef AVX2_STEP
+    __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3)),
+                               _mm256_add_ps(_mm256_add_ps(a4, a5), _mm256_add_ps(a6, a7)));
+    sum = _mm256_add_ps(sum, _mm256_add_ps(_mm256_add_ps(a8, a9), _mm256_add_ps(a10, a11)));
+    float lanes[8], total = 0.0f;
+    _mm256_storeu_ps(lanes, sum);
+    for (int l = 0; l < 8; l++) {
+        total += lanes[l];
+    }
+    return total;
+}
 
-    for (int i = 0; i < num_samples; i++) {
-        outputs[i] = biases[0]; // Start with the bias
-        for (int k = 0; k < embedding_size; k++) {
-            outputs[i] += inputs[i * embedding_size + k] * weights[k]; // Only one output
+__attribute__((target("avx512f"))) static float flopPeakAvx512(long long iterations) {
+    __m512 ROOFLINE_START(_mm512_set1_ps);
+    const __m512 m = _mm512_set1_ps(0.999999f), d = _mm512_set1_ps(1e-7f);
+#define AVX512_STEP(acc) acc = _mm512_fmadd_ps(acc, m, d);
+    for (long long it = 0; it < iterations; it++) {
+        ROOFLINE_FOR_CHAINS(AVX512_STEP)
+    }
+#undef AVX512_STEP
+    __m512 sum = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(a0, a1), _mm512_add_ps(a2, a3)),
+                               _mm512_add_ps(_mm512_add_ps(a4, a5), _mm512_add_ps(a6, a7)));
+    sum = _mm512_add_ps(sum, _mm512_add_ps(_mm512_add_ps(a8, a9), _mm512_add_ps(a10, a11)));
+    return _mm512_reduce_add_ps(sum);
+}
+#endif
+
+// Best FLOP rate of a peak kernel with every thread running it; lanes is its vector width
+static double measureFlopPeak(float (*kernel)(long long), int lanes) {
+    double best = 0.0;
+    int threads = maxThreads();
+    for (int r = 0; r < ROOFLINE_REPEATS; r++) {
+        float sink = 0.0f;
+        double start = wallSeconds();
+        #pragma omp parallel reduction(+:sink)
+        {
+            sink += kernel(ROOFLINE_ITERATIONS);
+        }
+        double elapsed = wallSeconds() - start;
+        double rate = 2.0 * ROOFLINE_ITERATIONS * ROOFLINE_CHAINS * lanes * threads / elapsed;
+        best = rate > best ? rate : best;
+        if (sink == 0.0f) {
+            printf("Unexpected peak kernel result\n");
         }
     }
+    return best;
+}
 
-    clock_t end_time = clock(); // End time measurement
-    double execution_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
-    printf("Dense Layer Time: %.4f seconds\n", execution_time);
+// Print one kernel against the roof: attainable = min(peak, intensity x bandwidth)
+static void printRooflineRow(const char *kernel, double flops, double bytes, double seconds, double peak, double bandwidth) {
+    double intensity = flops / bytes;
+    double achieved = flops / seconds;
+    double roof = intensity * bandwidth < peak ? intensity * bandwidth : peak;
+    printf("%-12s %10.3f %10.3f %10.3f %9.4f %9.2f %8.2f %9.2f %8.1f%%  %s\n", kernel, flops / 1e9, bytes / 1e9, intensity,
+           seconds, achieved / 1e9, bytes / seconds / 1e9, roof / 1e9,
+           flops > 0.0 ? 100.0 * achieved / roof : 100.0 * bytes / seconds / bandwidth,
+           intensity * bandwidth < peak ? "memory" : "compute");
 }
 
-// Apply sigmoid activation
-void sigmoidActivation(float *outputs, int size) {
-    clock_t start_time = clock(); // Start time measurement
+// Roofline of the pipeline kernels: measure the FLOP and bandwidth ceilings of the machine,
+// then time the tokenizer, dense layer and sigmoid on a token matrix larger than the cache
+// and report the FLOPs and bytes each moves against those ceilings
+void benchmarkRoofline(uint64_t seed) {
+    double baseline_peak = measureFlopPeak(flopPeakBaseline, 1);
+    double simd_peak = 0.0;
+    const char *simd_name = "none";
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx512f")) {
+        simd_peak = measureFlopPeak(flopPeakAvx512, 16);
+        simd_name = "AVX-512 FMA";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        simd_peak = measureFlopPeak(flopPeakAvx2, 8);
+        simd_name = "AVX2 FMA";
+    }
+#endif
 
-    for (int i = 0; i < size; i++) {
-        outputs[i] = 1.0f / (1.0f + expf(-outputs[i]));
+    // STREAM triad a = b + s * c over arrays that do not fit the last-level cache
+    size_t array_bytes = 2 * llcBytes() / 3;
+    array_bytes = array_bytes < ((size_t)64 << 20) ? (size_t)64 << 20 : array_bytes;
+    array_bytes = array_bytes > ((size_t)256 << 20) ? (size_t)256 << 20 : array_bytes;
+    long long n = (long long)(array_bytes / sizeof(float));
+    float *a = (float *)safe_aligned_malloc(array_bytes, "triadA");
+    float *b = (float *)safe_aligned_malloc(array_bytes, "triadB");
+    float *c = (float *)safe_aligned_malloc(array_bytes, "triadC");
+    #pragma omp parallel for schedule(static)
+    for (long long i = 0; i < n; i++) {
+        a[i] = 0.0f;
+        b[i] = 1.0f;
+        c[i] = 2.0f;
+    }
+    double triad_time = 1e30;
+    for (int r = 0; r < ROOFLINE_REPEATS; r++) {
+        double start = wallSeconds();
+        #pragma omp parallel for schedule(static)
+        for (long long i = 0; i < n; i++) {
+            a[i] = b[i] + 3.0f * c[i];
+        }
+        double elapsed = wallSeconds() - start;
+        triad_time = elapsed < triad_time ? elapsed : triad_time;
     }
+    double bandwidth = 3.0 * array_bytes / triad_time; // STREAM convention: write allocation not counted
+    free(a);
+    free(b);
+    free(c);
 
-    clock_t end_time = clock(); // End time measurement
-    double execution_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
-    printf("Sigmoid Activation Time: %.4f seconds\n", execution_time);
+    // The pipeline kernels are built for the baseline ISA, so their compute roof is the
+    // baseline peak; the SIMD peak is what a dispatched kernel could reach
+    printf("Roofline: %d threads, %.1f MB last-level cache\n", maxThreads(), llcBytes() / 1e6);
+    printf("Peak FLOP Rate (baseline build): %.2f GFLOP/s\n", baseline_peak / 1e9);
+    if (simd_peak > 0.0) {
+        printf("Peak FLOP Rate (%s): %.2f GFLOP/s\n", simd_name, simd_peak / 1e9);
+    }
+    printf("Triad Bandwidth: %.2f GB/s (%.1f MB arrays)\n", bandwidth / 1e9, array_bytes / 1e6);
+    printf("Ridge Point: %.2f FLOP/byte (baseline)", baseline_peak / bandwidth);
+    if (simd_peak > 0.0) {
+        printf(", %.2f FLOP/byte (%s)", simd_peak / bandwidth, simd_name);
+    }
+    printf("\n");
+
+    size_t target_bytes = 2 * llcBytes();
+    target_bytes = target_bytes < ((size_t)256 << 20) ? (size_t)256 << 20 : target_bytes;
+    target_bytes = target_bytes > ((size_t)1 << 30) ? (size_t)1 << 30 : target_bytes;
+    int num_samples = (int)(target_bytes / ((size_t)feature_size * sizeof(float)));
+    size_t matrix_bytes = (size_t)num_samples * feature_size * sizeof(float);
+    char *texts;
+    Post *posts = syntheticPosts(seed, 0, num_samples, &texts);
+    long long text_bytes = 0;
+    for (int i = 0; i < num_samples; i++) {
+        text_bytes += posts[i].text.length;
+    }
+    float *matrix = (float *)safe_aligned_malloc(matrix_bytes, "rooflineMatrix");
+    float *weights = (float *)safe_malloc((size_t)feature_size * sizeof(float), "rooflineWeights");
+    float biases[1] = { 0.0f };
+    float *outputs = (float *)safe_malloc(num_samples * sizeof(float), "rooflineOutputs");
+    init_weights(weights, feature_size, 1, seed, INIT_XAVIER);
+    memset(matrix, 0, matrix_bytes);
+
+    double times[3] = { 1e30, 1e30, 1e30 };
+    for (int r = 0; r < ROOFLINE_REPEATS; r++) {
+        double start = wallSeconds();
+        tokenizeAndEmbed(posts, matrix, num_samples, NULL);
+        double elapsed = wallSeconds() - start;
+        times[0] = elapsed < times[0] ? elapsed : times[0];
+
+        start = wallSeconds();
+        denseLayer(matrix, weights, biases, outputs, num_samples, feature_size);
+        elapsed = wallSeconds() - start;
+        times[1] = elapsed < times[1] ? elapsed : times[1];
+    }
+    // Sigmoid over the whole matrix, so that its data comes from memory as well
+    long long elements = (long long)num_samples * feature_size;
+    for (int r = 0; r < ROOFLINE_REPEATS; r++) {
+        double start = wallSeconds();
+        sigmoidActivation(matrix, (int)elements);
+        double elapsed = wallSeconds() - start;
+        times[2] = elapsed < times[2] ? elapsed : times[2];
+    }
+
+    // Compulsory traffic of each kernel. The tokenizer does no floating-point arithmetic.
+    printf("\n%-12s %10s %10s %10s %9s %9s %8s %9s %9s  %s\n", "kernel", "GFLOP", "GB", "FLOP/byte", "seconds",
+           "GFLOP/s", "GB/s", "roof", "of roof", "bound");
+    printRooflineRow("tokenizer", 0.0, (double)text_bytes + matrix_bytes, times[0], baseline_peak, bandwidth);
+    printRooflineRow("denseLayer", 2.0 * elements, (double)matrix_bytes + feature_size * sizeof(float) + num_samples * sizeof(float),
+                     times[1], baseline_peak, bandwidth);
+    printRooflineRow("sigmoid", (double)SIGMOID_FLOPS * elements, 2.0 * elements * sizeof(float), times[2], baseline_peak, bandwidth);
+    printf("(tokenizer: share of the triad bandwidth, as it does no floating-point work)\n");
+    printf("(sigmoid: %d FLOPs per element, counting expf as %d)\n", SIGMOID_FLOPS, EXPF_FLOPS);
+
+    free(posts);
+    free(texts);
+    free(matrix);
+    free(weights);
+    free(outputs);
 }
 
-// Evaluate model predictions
-float evaluate(float *outputs, int *labels, int num_samples) {
-    clock_t start_time = clock(); // Start time measurement
+// Run each loader in its own child process, so that its peak resident set is its own, and
+// report time, peak memory and whether both produced the same split
+void benchmarkLoaders(const char *filename, uint64_t seed) {
+    typedef int (*Loader)(const char *, Post **, Post **, int *, int *, uint64_t);
+    const Loader loaders[2] = { loadAndSplitDatasetLegacy, loadAndSplitDataset };
+    const char *names[2] = { "realloc loader", "prescan loader" };
+    int pipes[2][2];
 
-    int correct = 0;
+    printf("Loader benchmark on %s\n", filename);
+    fflush(stdout);
+    for (int l = 0; l < 2; l++) {
+        if (pipe(pipes[l]) != 0) {
+            printf("Error: Could not create a pipe for the loader benchmark\n");
+            exit(1);
+        }
+        pid_t child = fork();
+        if (child < 0) {
+            printf("Error: Could not fork the loader benchmark\n");
+            exit(1);
+        }
+        if (child == 0) {
+            Post *trainSet = NULL, *testSet = NULL;
+            int trainSize, testSize;
+            double start = wallSeconds();
+            loaders[l](filename, &trainSet, &testSet, &trainSize, &testSize, seed);
+            double elapsed = wallSeconds() - start;
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            uint64_t checksum = datasetChecksum(testSet, testSize, datasetChecksum(trainSet, trainSize, 14695981039346656037ull));
+            printf("%s: %d samples, %.4f seconds, peak RSS %.1f MB\n", names[l], trainSize + testSize, elapsed,
+                   usage.ru_maxrss / 1024.0);
+            fflush(stdout);
+            if (write(pipes[l][1], &checksum, sizeof(checksum)) != (ssize_t)sizeof(checksum)) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+        close(pipes[l][1]);
+        waitpid(child, NULL, 0);
+    }
 
-    for (int i = 0; i < num_samples; i++) {
-        int predicted_label = outputs[i] > 0.6f ? 4 : 0; // If > 0.6, predict positive (4), else negative (0)
-        if (predicted_label == labels[i]) {
-            correct++;
+    uint64_t checksums[2] = { 0, 1 };
+    for (int l = 0; l < 2; l++) {
+        if (read(pipes[l][0], &checksums[l], sizeof(uint64_t)) != (ssize_t)sizeof(uint64_t)) {
+            checksums[l] = (uint64_t)l; // Child failed: report a mismatch
         }
+        close(pipes[l][0]);
     }
+    printf("Loaders Produce Identical Splits: %s\n", checksums[0] == checksums[1] ? "yes" : "NO");
+}
 
-    clock_t end_time = clock(); // End time measurement
-    double execution_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
-    printf("Evaluation Time: %.4f seconds\n", execution_time);
+int main(int argc, char **argv) {
+    double start_time = wallSeconds(); // Start time measurement
+    initByteClasses();
 
-    return (float)correct / num_samples;
-}
+    const char *dataset_path = "training.1600000.processed.noemoticon.csv";
+    uint64_t seed = (uint64_t)time(NULL);
+    WeightInit init_scheme = INIT_XAVIER;
+    int bench_reduce = 0;
+    int bench_kernels = 0;
+    int bench_gather = 0;
+    int bench_stream = 0;
+    int bench_loader = 0;
+    int hash_bits = CASCADE_HASH_BITS;
+    int remap_features = 0;
+    float cascade_loss = -1.0f;
+    float cascade_band = -1.0f; // Tuned from cascade_loss unless given
+    int ensemble_models = 0;
+    const char *ensemble_path = NULL;
+    int explain_k = 0;
+    const char *explain_path = NULL;
+    int top_k = 0;
+    int knn_k = 0;
+    int knn_ef = 64;
+    const char *knn_index_path = NULL;
+    int pq_k = 0;
+    int simhash_distance = -1;
+    int cnn_epochs = 0;
+    int top_users = 0;
+    const char *single_tweet = NULL;
+    int window = 0;
+    int window_stride = 0;
+    const char *documents_path = NULL;
+    const char *feature_store_name = NULL;
+    int spill_epochs = 0;
+    int measure_energy = 0;
+    const char *metrics_path = NULL;
+    int measure_latency = 0;
+    int bench_histogram = 0;
+    int bench_scaling = 0;
+    int bench_roofline = 0;
+    const char *scaling_sizes = "10K,100K,1M";
+    const char *scaling_threads = NULL;
+    int scaling_repeats = 3;
+    double metrics_interval = 1.0;
+    const char *spill_dir = "/tmp";
+    int feature_store_remove = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--init") == 0 && i + 1 < argc) {
+            const char *scheme = argv[++i];
+            if (strcmp(scheme, "xavier") == 0) {
+                init_scheme = INIT_XAVIER;
+            } else if (strcmp(scheme, "he") == 0) {
+                init_scheme = INIT_HE;
+            } else {
+                printf("Error: Unknown initialization scheme %s\n", scheme);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            setThreads(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--bench-reduce") == 0) {
+            bench_reduce = 1;
+        } else if (strcmp(argv[i], "--remap") == 0) {
+            remap_features = 1;
+        } else if (strcmp(argv[i], "--nt-stores") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "auto") == 0) {
+                non_temporal_mode = NT_AUTO;
+            } else if (strcmp(mode, "on") == 0) {
+                non_temporal_mode = NT_ALWAYS;
+            } else if (strcmp(mode, "off") == 0) {
+                non_temporal_mode = NT_NEVER;
+            } else {
+                printf("Error: Unknown --nt-stores mode %s\n", mode);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-loader") == 0) {
+            bench_loader = 1;
+        } else if (strcmp(argv[i], "--bench-stream") == 0) {
+            bench_stream = 1;
+        } else if (strcmp(argv[i], "--bench-gather") == 0) {
+            bench_gather = 1;
+        } else if (strcmp(argv[i], "--bench-kernels") == 0) {
+            bench_kernels = 1;
+        } else if (strcmp(argv[i], "--features") == 0 && i + 1 < argc) {
+            feature_size = atoi(argv[++i]);
+            if (feature_size < 1) {
+                printf("Error: --features needs N >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--hash-bits") == 0 && i + 1 < argc) {
+            hash_bits = atoi(argv[++i]);
+            if (hash_bits < 1 || hash_bits > 30) {
+                printf("Error: --hash-bits needs between 1 and 30 bits\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cascade") == 0 && i + 1 < argc) {
+            cascade_loss = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--cascade-band") == 0 && i + 1 < argc) {
+            cascade_band = (float)atof(argv[++i]);
+            if (cascade_band < 0.0f || cascade_band > 1.0f) {
+                printf("Error: --cascade-band needs a width between 0 and 1\n");
+                return 1;
+            }
+            cascade_loss = cascade_loss >= 0.0f ? cascade_loss : 0.0f;
+        } else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc) {
+            ensemble_models = atoi(argv[++i]);
+            if (ensemble_models < 1 || ensemble_models > NUM_FEATURES) {
+                printf("Error: --ensemble needs between 1 and %d models\n", NUM_FEATURES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--ensemble-out") == 0 && i + 1 < argc) {
+            ensemble_path = argv[++i];
+        } else if (strcmp(argv[i], "--explain") == 0 && i + 1 < argc) {
+            explain_k = atoi(argv[++i]);
+            if (explain_k < 1) {
+                printf("Error: --explain needs K >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--explain-out") == 0 && i + 1 < argc) {
+            explain_path = argv[++i];
+        } else if (strcmp(argv[i], "--knn") == 0 && i + 1 < argc) {
+            knn_k = atoi(argv[++i]);
+            if (knn_k < 1) {
+                printf("Error: --knn needs K >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--knn-ef") == 0 && i + 1 < argc) {
+            knn_ef = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--knn-index") == 0 && i + 1 < argc) {
+            knn_index_path = argv[++i];
+        } else if (strcmp(argv[i], "--pq") == 0 && i + 1 < argc) {
+            pq_k = atoi(argv[++i]);
+            if (pq_k < 1) {
+                printf("Error: --pq needs K >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--simhash") == 0 && i + 1 < argc) {
+            simhash_distance = atoi(argv[++i]);
+            if (simhash_distance < 0 || simhash_distance > SIMHASH_BLOCKS - 1) {
+                printf("Error: --simhash needs a distance between 0 and %d bits\n", SIMHASH_BLOCKS - 1);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--windows") == 0 && i + 1 < argc) {
+            window = atoi(argv[++i]);
+            if (window < 1) {
+                printf("Error: --windows needs W >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--window-stride") == 0 && i + 1 < argc) {
+            window_stride = atoi(argv[++i]);
+            if (window_stride < 1) {
+                printf("Error: --window-stride needs S >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--score-docs") == 0 && i + 1 < argc) {
+            documents_path = argv[++i];
+        } else if (strcmp(argv[i], "--feature-store") == 0 && i + 1 < argc) {
+            feature_store_name = argv[++i];
+        } else if (strcmp(argv[i], "--feature-store-remove") == 0) {
+            feature_store_remove = 1;
+        } else if (strcmp(argv[i], "--spill-epochs") == 0 && i + 1 < argc) {
+            spill_epochs = atoi(argv[++i]);
+            if (spill_epochs < 1) {
+                printf("Error: --spill-epochs needs E >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--spill-dir") == 0 && i + 1 < argc) {
+            spill_dir = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval = atof(argv[++i]);
+            if (metrics_interval <= 0.0) {
+                printf("Error: --metrics-interval needs SECONDS > 0\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            measure_latency = 1;
+        } else if (strcmp(argv[i], "--bench-roofline") == 0) {
+            bench_roofline = 1;
+        } else if (strcmp(argv[i], "--bench-scaling") == 0) {
+            bench_scaling = 1;
+        } else if (strcmp(argv[i], "--scaling-sizes") == 0 && i + 1 < argc) {
+            scaling_sizes = argv[++i];
+        } else if (strcmp(argv[i], "--scaling-threads") == 0 && i + 1 < argc) {
+            scaling_threads = argv[++i];
+        } else if (strcmp(argv[i], "--scaling-repeats") == 0 && i + 1 < argc) {
+            scaling_repeats = atoi(argv[++i]);
+            if (scaling_repeats < 1) {
+                printf("Error: --scaling-repeats needs R >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-histogram") == 0) {
+            bench_histogram = 1;
+        } else if (strcmp(argv[i], "--energy") == 0) {
+            measure_energy = 1;
+        } else if (strcmp(argv[i], "--tweet") == 0 && i + 1 < argc) {
+            single_tweet = argv[++i];
+        } else if (strcmp(argv[i], "--top-users") == 0 && i + 1 < argc) {
+            top_users = atoi(argv[++i]);
+            if (top_users < 1) {
+                printf("Error: --top-users needs K >= 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cnn") == 0 && i + 1 < argc) {
+            cnn_epochs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topk") == 0 && i + 1 < argc) {
+            top_k = atoi(argv[++i]);
+            if (top_k < 1) {
+                printf("Error: --topk needs K >= 1\n");
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            dataset_path = argv[i];
+        }
+    }
+
+    if (bench_reduce) {
+        benchmarkReductions(seed);
+        return 0;
+    }
+    // Windows are rows of the dense layer, so they are at most feature_size characters
+    int run_windowed = window > 0;
+    if (window > feature_size) {
+        printf("Error: --windows %d is wider than the %d features of a row (see --features)\n", window, feature_size);
+        return 1;
+    }
+    if (window == 0) {
+        window = feature_size;
+    }
+    if (window_stride == 0 || window_stride > window) {
+        window_stride = window > 1 ? window / 2 : 1;
+    }
 
-int main() {
-    clock_t start_time = clock(); // Start time measurement
+    if (bench_kernels) {
+        benchmarkKernels(seed);
+        return 0;
+    }
+    if (bench_gather) {
+        benchmarkGather(seed);
+        return 0;
+    }
+    if (bench_stream) {
+        benchmarkStreamingStores(seed);
+        return 0;
+    }
+    if (bench_loader) {
+        benchmarkLoaders(dataset_path, seed);
+        return 0;
+    }
+    if (bench_histogram) {
+        benchmarkHistogram(seed);
+        return 0;
+    }
+    if (bench_scaling) {
+        benchmarkScaling(dataset_path, seed, scaling_sizes, scaling_threads, scaling_repeats);
+        return 0;
+    }
+    if (bench_roofline) {
+        benchmarkRoofline(seed);
+        return 0;
+    }
 
     printf("Starting program...\n");
+    printf("Seed: %llu\n", (unsigned long long)seed);
+    if (measure_energy) {
+        energyInit();
+    }
+    EnergySample run_energy = energySample();
+    if (metrics_path) {
+        metricsStart(metrics_path, metrics_interval);
+    }
+    printf("Features: %d (%s dense kernel)\n", feature_size,
+           lookupDenseKernel(feature_size) == denseKernelGeneric ? "generic" : "specialized");
+
+    // With a published feature store the dataset is only read by the modes that need the text
+    FeatureStore store = {0};
+    struct stat dataset_stat = {0};
+    int attached = 0;
+    if (feature_store_name) {
+        if (stat(dataset_path, &dataset_stat) != 0) {
+            printf("Error: Could not open file %s\n", dataset_path);
+            return 1;
+        }
+        attached = featureStoreAttach(&store, feature_store_name, &dataset_stat, seed);
+    }
+    int needs_text = run_windowed || measure_latency || top_k > 0 || cascade_loss >= 0.0f || remap_features || spill_epochs > 0 ||
+                     knn_k > 0 || pq_k > 0 || simhash_distance >= 0 || top_users > 0 || cnn_epochs > 0 || explain_k > 0;
 
     Post *trainSet = NULL, *testSet = NULL;
     int trainSize, testSize;
-    int num_samples = loadAndSplitDataset("training.1600000.processed.noemoticon.csv", &trainSet, &testSet, &trainSize, &testSize);
+    if (attached) {
+        trainSize = store.header->train_size;
+        testSize = store.header->test_size;
+    }
+    if (!attached || needs_text) {
+        int train_rows = trainSize, test_rows = testSize;
+        loadAndSplitDataset(dataset_path, &trainSet, &testSet, &trainSize, &testSize, seed);
+        if (attached && (trainSize != train_rows || testSize != test_rows)) {
+            printf("Error: Feature store %s does not match the dataset split\n", feature_store_name);
+            return 1;
+        }
+    }
 
     if (trainSize == 0 || testSize == 0) {
         printf("Error: No samples found in dataset.\n");
@@ -212,29 +6443,58 @@ int main() {
 
     printf("Loaded %d training samples and %d test samples.\n", trainSize, testSize);
 
-    // Memory for the labels and token IDs for training
-    int *trainLabels = (int *)safe_malloc(trainSize * sizeof(int), "trainLabels");
-    for (int i = 0; i < trainSize; i++) {
-        trainLabels[i] = trainSet[i].label;
+    if (feature_store_name && !attached &&
+        !featureStoreCreate(&store, feature_store_name, &dataset_stat, seed, trainSize, testSize)) {
+        // Another process created it since we looked; use its features
+        attached = featureStoreAttach(&store, feature_store_name, &dataset_stat, seed);
+    }
+
+    // Memory for the labels and token IDs, in the feature store when there is one
+    int *trainLabels = store.header ? store.train_labels : (int *)safe_malloc(trainSize * sizeof(int), "trainLabels");
+    int *testLabels = store.header ? store.test_labels : (int *)safe_malloc(testSize * sizeof(int), "testLabels");
+    float *trainTokenIds = store.header ? store.train_features
+                           : (float *)safe_aligned_malloc((size_t)trainSize * feature_size * sizeof(float), "trainTokenIds");
+    float *testTokenIds = store.header ? store.test_features
+                          : (float *)safe_aligned_malloc((size_t)testSize * feature_size * sizeof(float), "testTokenIds");
+    if (!attached) {
+        for (int i = 0; i < trainSize; i++) {
+            trainLabels[i] = trainSet[i].label;
+        }
+        for (int i = 0; i < testSize; i++) {
+            testLabels[i] = testSet[i].label;
+        }
     }
 
-    float *trainTokenIds = (float *)safe_malloc(trainSize * MAX_TOKENS * sizeof(float), "trainTokenIds");
-    float *trainWeights = (float *)safe_malloc(NUM_FEATURES * NUM_FEATURES * sizeof(float), "trainWeights");
+    // The weight matrix holds NUM_FEATURES independently initialized rows of feature_size
+    // weights; the dense layer uses the first, the ensemble the first N
+    float *trainWeights = (float *)safe_malloc((size_t)NUM_FEATURES * feature_size * sizeof(float), "trainWeights");
     float *trainBiases = (float *)safe_malloc(NUM_FEATURES * sizeof(float), "trainBiases");
-    float *trainOutputs = (float *)safe_malloc(trainSize * NUM_FEATURES * sizeof(float), "trainOutputs");
+    float *trainOutputs = (float *)safe_malloc(trainSize * sizeof(float), "trainOutputs");
+    // SimHash signatures, a compact column next to the labels
+    uint64_t *trainSignatures = NULL, *testSignatures = NULL;
+    if (simhash_distance >= 0) {
+        trainSignatures = (uint64_t *)safe_malloc(trainSize * sizeof(uint64_t), "trainSignatures");
+        testSignatures = (uint64_t *)safe_malloc(testSize * sizeof(uint64_t), "testSignatures");
+    }
 
-    srand(time(NULL));
-    init_weights(trainWeights, NUM_FEATURES);
+    init_weights(trainWeights, feature_size, NUM_FEATURES, seed, init_scheme);
 
     for (int i = 0; i < NUM_FEATURES; i++) {
         trainBiases[i] = 0.0f;
     }
 
     // Tokenizing and embedding training dataset
-    tokenizeAndEmbed(trainSet, trainTokenIds, trainSize);
+    if (!attached) {
+        tokenizeAndEmbed(trainSet, trainTokenIds, trainSize, trainSignatures);
+    } else if (trainSignatures) {
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < trainSize; i++) {
+            trainSignatures[i] = simHashTweet(trainSet[i].text);
+        }
+    }
 
     // Train the model with the training set
-    denseLayer(trainTokenIds, trainWeights, trainBiases, trainOutputs, trainSize, NUM_FEATURES);
+    denseLayer(trainTokenIds, trainWeights, trainBiases, trainOutputs, trainSize, feature_size);
 
     // Apply sigmoid activation for training set
     sigmoidActivation(trainOutputs, trainSize);
@@ -244,42 +6504,132 @@ int main() {
     //printf("Training set Accuracy: %.2f%%\n", accuracy * 100);
 
     // Now, evaluate on test set
-    int *testLabels = (int *)safe_malloc(testSize * sizeof(int), "testLabels");
-    for (int i = 0; i < testSize; i++) {
-        testLabels[i] = testSet[i].label;
-    }
+    float *testOutputs = (float *)safe_malloc(testSize * sizeof(float), "testOutputs");
 
-    float *testTokenIds = (float *)safe_malloc(testSize * MAX_TOKENS * sizeof(float), "testTokenIds");
-    float *testOutputs = (float *)safe_malloc(testSize * NUM_FEATURES * sizeof(float), "testOutputs");
+    double test_start_time = wallSeconds();
+    EnergySample test_energy = energySample();
 
     // Tokenizing and embedding test dataset
-    tokenizeAndEmbed(testSet, testTokenIds, testSize);
+    if (!attached) {
+        tokenizeAndEmbed(testSet, testTokenIds, testSize, testSignatures);
+        if (store.header) {
+            featureStorePublish(&store);
+        }
+    } else if (testSignatures) {
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < testSize; i++) {
+            testSignatures[i] = simHashTweet(testSet[i].text);
+        }
+    }
 
     // Use the trained model to make predictions on the test set
-    denseLayer(testTokenIds, trainWeights, trainBiases, testOutputs, testSize, NUM_FEATURES);
+    denseLayer(testTokenIds, trainWeights, trainBiases, testOutputs, testSize, feature_size);
 
     // Apply sigmoid activation for test set
     sigmoidActivation(testOutputs, testSize);
+    double full_test_time = wallSeconds() - test_start_time;
+    double test_joules = energy_enabled ? energyJoulesSince(&test_energy) : 0.0;
 
     // Evaluate the test set
     float testAccuracy = evaluate(testOutputs, testLabels, testSize);
     printf("Test set Accuracy: %.2f%%\n", testAccuracy * 100);
+    if (energy_enabled) {
+        if (test_joules < 0.0) {
+            printf("Test Scoring Energy: unavailable\n");
+        } else {
+            printf("Test Scoring Energy: %.4f joules (%.2f joules per million tweets)\n", test_joules,
+                   test_joules * 1e6 / testSize);
+        }
+    }
+
+    if (run_windowed) {
+        runWindowed(testSet, testLabels, testOutputs, testSize, trainWeights, trainBiases, window, window_stride);
+    }
+
+    if (documents_path) {
+        scoreDocumentFile(documents_path, trainWeights, trainBiases, window, window_stride);
+    }
+
+    if (single_tweet) {
+        float score = scoreTweet(stringView(single_tweet), trainWeights, trainBiases, NULL);
+        printf("Tweet Score: %.6f (%s)\n", score, score > DECISION_THRESHOLD ? "positive" : "negative");
+    }
+
+    if (measure_latency) {
+        runLatency(testSet, testSize, trainWeights, trainBiases);
+    }
+
+    if (top_k > 0) {
+        runTopK(testSet, testOutputs, testSize, top_k);
+    }
+
+    if (cascade_loss >= 0.0f) {
+        runCascade(trainSet, trainLabels, trainTokenIds, trainSize, testSet, testLabels, testSize,
+                   trainWeights, trainBiases, full_test_time, cascade_loss, cascade_band, hash_bits);
+    }
+
+    if (remap_features) {
+        runFeatureRemap(trainSet, trainLabels, trainSize, testSet, testSize, hash_bits);
+    }
+
+    if (spill_epochs > 0) {
+        runSpilledTraining(trainSet, trainLabels, trainSize, testSet, testLabels, testSize, spill_epochs, hash_bits,
+                           spill_dir, seed);
+    }
+
+    if (ensemble_models > 0) {
+        // Rows of the weight matrix are independently initialized models
+        runEnsemble(testTokenIds, testLabels, testSize, trainWeights, trainBiases, ensemble_models, ensemble_path);
+    }
+
+    if (knn_k > 0) {
+        runKnn(trainSet, trainLabels, trainSize, testSet, testLabels, testSize, knn_k, knn_ef, knn_index_path, seed);
+    }
+
+    if (pq_k > 0) {
+        runProductQuantization(trainSet, trainLabels, trainSize, testSet, testLabels, testSize, pq_k, seed);
+    }
+
+    if (simhash_distance >= 0) {
+        runSimHash(trainSet, trainSignatures, trainSize, testSet, testSignatures, testSize, simhash_distance);
+    }
+
+    if (top_users > 0) {
+        runTopUsers(trainSet, trainSize, testSet, testSize, top_users);
+    }
+
+    if (cnn_epochs > 0) {
+        runCharCnn(trainSet, trainLabels, trainSize, testSet, testLabels, testSize, cnn_epochs, seed);
+    }
+
+    if (explain_k > 0) {
+        runExplain(testSet, testTokenIds, testLabels, testSize, trainWeights, trainBiases, explain_k, explain_path);
+    }
 
-    clock_t end_time = clock(); // End time measurement
-    double execution_time = ((double)(end_time - start_time)) / CLOCKS_PER_SEC;
+    double end_time = wallSeconds(); // End time measurement
+    double execution_time = end_time - start_time;
     printf("Total Execution Time: %.4f seconds\n", execution_time);
+    printStageEnergy("Total", &run_energy, execution_time);
+    metricsStop();
 
     // Free memory
     free(trainSet);
     free(testSet);
-    free(trainLabels);
-    free(testLabels);
-    free(trainTokenIds);
-    free(testTokenIds);
+    freeDatasetArena();
+    if (store.header) {
+        featureStoreDetach(&store, feature_store_remove);
+    } else {
+        free(trainLabels);
+        free(testLabels);
+        free(trainTokenIds);
+        free(testTokenIds);
+    }
     free(trainWeights);
     free(trainBiases);
     free(trainOutputs);
     free(testOutputs);
+    free(trainSignatures);
+    free(testSignatures);
 
     return 0;
 }